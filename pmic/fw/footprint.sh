@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# footprint.sh - per-symbol flash/RAM report with a budget check
+#
+# usage: footprint.sh <elf> <toolchain-prefix> <flash-budget> <ram-budget> [stack-reserve]
+#
+# Flash holds .init/.text/.rodata and the load image of .data, RAM holds
+# .data, .bss and the stack reserve. The totals come from the section sizes
+# (size -A), so alignment padding, the vector table and sizeless or weak
+# symbols are counted, the nm listing only shows where the bytes go.
+# Exits non-zero when a budget is exceeded.
+#
+
+ELF=$1
+PREFIX=$2
+FLASH_BUDGET=$3
+RAM_BUDGET=$4
+STACK_RESERVE=${5:-0}
+
+"$PREFIX-nm" -S -t d --size-sort "$ELF" | awk '
+NF == 4 {
+    type = toupper($3)
+    if (type == "T" || type == "R" || type == "W" || type == "V") {
+        printf "flash %6d  %s\n", $2, $4
+    } else if (type == "D" || type == "G") {
+        printf "both  %6d  %s\n", $2, $4
+    } else if (type == "B" || type == "S" || type == "C") {
+        printf "ram   %6d  %s\n", $2, $4
+    }
+}'
+
+"$PREFIX-size" -A -d "$ELF" | awk \
+    -v flash_budget="$FLASH_BUDGET" \
+    -v ram_budget="$RAM_BUDGET" \
+    -v stack="$STACK_RESERVE" '
+# Sections not loaded on the target
+$1 !~ /^\./ || $1 ~ /^\.(debug|comment|riscv|stab|note|symtab|strtab|shstrtab)/ {
+    next
+}
+NF == 3 {
+    size = $2 + 0
+    if ($1 == ".bss") {
+        ram += size
+    } else if ($3 + 0 >= 536870912) {
+        # 0x20000000, RAM with a load image in flash
+        flash += size
+        ram += size
+    } else {
+        flash += size
+    }
+}
+END {
+    ram += stack
+    printf "\n"
+    printf "flash: %6d / %6d bytes (%d%%)\n", flash, flash_budget, flash * 100 / flash_budget
+    printf "ram  : %6d / %6d bytes (%d%%, %d stack reserve)\n", ram, ram_budget, ram * 100 / ram_budget, stack
+    if (flash > flash_budget || ram > ram_budget) {
+        printf "budget: EXCEEDED\n"
+        exit 1
+    }
+    printf "budget: ok\n"
+}'
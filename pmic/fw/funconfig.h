@@ -3,5 +3,45 @@
 
 #define CH32V003           1
 
+// PMIC build features, normally selected via PROFILE=... in the Makefile
+
+#ifndef PMIC_DEBUG_TRACE
+#define PMIC_DEBUG_TRACE   0   // printf() trace over SWIO, costs ~2.5KB flash
+#endif
+
+#ifndef PMIC_LED_COUNT
+#define PMIC_LED_COUNT     1   // WS2812 LEDs chained on PC6
+#endif
+
+#ifndef PMIC_BOOTLOADER
+#define PMIC_BOOTLOADER    0   // Host may reboot the PMIC into the system bootloader
+#endif
+
+#ifndef PMIC_PWR_POLICY
+#define PMIC_PWR_POLICY    1   // Power-on policy after PMIC reset, see PMIC_PWR_POLICY_* in pmic_regs.h (register 3)
 #endif
 
+#ifndef PMIC_BOOT_DELAY_MS
+#define PMIC_BOOT_DELAY_MS 0   // Settle time before the first power-on check, below IWDG timeout
+#endif
+
+#if PMIC_DEBUG_TRACE
+#define FUNCONF_USE_DEBUGPRINTF 1
+#else
+#define FUNCONF_USE_DEBUGPRINTF 0
+#define FUNCONF_USE_UARTPRINTF  0
+#define FUNCONF_NULL_PRINTF     1
+#define FUNCONF_DEBUG_HARDFAULT 0
+#endif
+
+// WS2812 DMA ring, in LED slots (must be divisible by 4). Half of it is refilled
+// per DMA interrupt, so the whole frame (reset break + LEDs + tail) fits in it
+// for short chains; longer chains are streamed through a 16 slot ring.
+#define WS2812_FRAME_SLOTS (PMIC_LED_COUNT + 2 + 1)
+#if WS2812_FRAME_SLOTS * 2 < 16
+#define DMALEDS            (((WS2812_FRAME_SLOTS * 2 + 3) / 4) * 4)
+#else
+#define DMALEDS            16
+#endif
+
+#endif
@@ -132,27 +132,33 @@ void I2C1_EV_IRQHandler(void) {
     }
 
     if (STAR1 & I2C_STAR1_TXE) { // Read event
+        // DATAR is loaded one byte ahead: TXE means the byte loaded last time moved to the shift register,
+        // so that one is reported now. A read the master ends early never reports the byte left in DATAR.
         i2c_slave_state.writing = false;
         if (i2c_slave_state.address2matched) {
+            if ((i2c_slave_state.read_callback2 != NULL) && (i2c_slave_state.position > i2c_slave_state.offset)) {
+                i2c_slave_state.read_callback2(i2c_slave_state.position - 1);
+            }
             if ((i2c_slave_state.registers2 != NULL) && (i2c_slave_state.position < i2c_slave_state.size2)) {
                 I2C1->DATAR = i2c_slave_state.registers2[i2c_slave_state.position];
-                if (i2c_slave_state.read_callback2 != NULL) {
-                    i2c_slave_state.read_callback2(i2c_slave_state.position);
-                }
-                i2c_slave_state.position++;
             } else {
                 I2C1->DATAR = 0xde;
             }
+            if (i2c_slave_state.position <= i2c_slave_state.size2) {
+                i2c_slave_state.position++;
+            }
         } else {
+            if ((i2c_slave_state.read_callback1 != NULL) && (i2c_slave_state.position > i2c_slave_state.offset)) {
+                i2c_slave_state.read_callback1(i2c_slave_state.position - 1);
+            }
             if ((i2c_slave_state.registers1 != NULL) && (i2c_slave_state.position < i2c_slave_state.size1)) {
                 I2C1->DATAR = i2c_slave_state.registers1[i2c_slave_state.position];
-                if (i2c_slave_state.read_callback1 != NULL) {
-                    i2c_slave_state.read_callback1(i2c_slave_state.position);
-                }
-                i2c_slave_state.position++;
             } else {
                 I2C1->DATAR = 0xca;
             }
+            if (i2c_slave_state.position <= i2c_slave_state.size1) {
+                i2c_slave_state.position++;
+            }
         }
     }
 
@@ -1,6 +1,7 @@
 #include "ch32v003fun.h"
 #include "i2c_slave.h"
 #include "ws2812.h"
+#include "pmic_regs.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -9,46 +10,73 @@
 #define TP4056_CHRG_PIN 5
 #define TP4056_STDBY_PIN 6
 #define LTE_LED_PIN 1
-#define BAT_LOW_SH_TIME 10
+#define BAT_LOW_SH_TIME 50     // s, deadline for the host to acknowledge a low battery shutdown
 #define BAT_LOW_ADC_THRESH 560
-#define ADC_MEAS_INT 5000
+#define BAT_LOW_SAMPLES 3      // consecutive low samples before asking for shutdown, rides out modem TX sags
+#define BAT_LOW_ADC_CLEAR 575  // ~3.7V, recovered above this a pending shutdown request is withdrawn
+#define BAT_ON_ADC_THRESH 590  // ~3.8V, battery recovered enough to power on
+#define ADC_MEAS_INT PMIC_ADC_INTERVAL
 #define BTN_LED_COUNTER 1000
+#define HB_CHECK_INT 1000      // ms between heartbeat register checks
+#define PWR_CYCLE_OFF_MS 5000  // ENA low time when power-cycling a hung host
+#define IWDG_TIMEOUT_MS 2000   // LSI 128kHz / 128 -> 1 tick per ms
+#define OFF_POLL_MS 50         // button/charger poll while the host is off
+#define OFF_ADC_INT 1000       // battery measurement interval while the host is off
 
-#define I2C_DEV_ADDR 9
+#if PMIC_BOOTLOADER
+#define PMIC_CAPS (PMIC_CAP_HEARTBEAT | PMIC_CAP_PWR_POLICY | PMIC_CAP_SD_HANDSHAKE | PMIC_CAP_BTN_LATCH | PMIC_CAP_BOOTLOADER)
+#else
+#define PMIC_CAPS (PMIC_CAP_HEARTBEAT | PMIC_CAP_PWR_POLICY | PMIC_CAP_SD_HANDSHAKE | PMIC_CAP_BTN_LATCH)
+#endif
 
-#define I2C_REG_TM        4
-#define I2C_REG_LED_R     8
-#define I2C_REG_LED_G     9
-#define I2C_REG_LED_B    10
-#define I2C_REG_LED_UPD  11
-#define I2C_REG_ADC      12
-#define I2C_REG_IN_STATE 14
-#define I2C_REG_UID      16
-#define I2C_REG_OFF      31
+// Why the host is off
+#define OFF_REASON_BOOT    0 // PMIC just started
+#define OFF_REASON_HOST    1 // Host wrote PMIC_OFF_SHUTDOWN
+#define OFF_REASON_BATTERY 2 // Battery low countdown expired
 
-typedef struct in_state
-{
-    uint8_t charge : 1;
-    uint8_t stdby : 1;
-    uint8_t lte : 1;
-    uint8_t pwr : 1;
-    uint8_t bat_low : 1;
-    uint8_t : 3;
-} in_state_t;
+#if PMIC_DEBUG_TRACE
+#define trace(...) printf(__VA_ARGS__)
+#else
+#define trace(...) do { } while (0)
+#endif
 
-static uint8_t i2c_registers[32] = {0x00};
+static struct pmic_regs regs;
+static volatile uint8_t host_off_req = 0;
+static volatile uint8_t in_state_read = 0;
 
 void onWrite(uint8_t reg, uint8_t length)
 {
-    funDigitalWrite(PA2, i2c_registers[0] & 1);
-    if ((i2c_registers[I2C_REG_OFF] & 0xff) == 0xff) {
+    // Read-only identification, restore whatever the host wrote there
+    regs.version = PMIC_PROTO_VERSION;
+    regs.caps = PMIC_CAPS;
+    if (regs.off == PMIC_OFF_SHUTDOWN) {
         GPIOD->OUTDR &= ~(1 << ENA_PIN);
+        host_off_req = 1;
+    }
+#if PMIC_BOOTLOADER
+    if (regs.off == PMIC_OFF_BOOTLOADER) {
+        // Boot from the system flash on the next reset, ENA stays untouched
+        FLASH->BOOT_MODEKEYR = FLASH_KEY1;
+        FLASH->BOOT_MODEKEYR = FLASH_KEY2;
+        FLASH->STATR = 1 << 14;
+        PFIC->SCTLR = 1 << 31;
+    }
+#endif
+}
+
+void onRead(uint8_t reg)
+{
+    // in_state went out on the bus, i2c_slave.c reports a byte once it is shifted out, not when it
+    // is preloaded; the main loop re-arms the button latch
+    if (reg == PMIC_REG_IN_STATE) {
+        in_state_read = 1;
     }
 }
 
+// All chained LEDs show the same colour
 uint32_t WS2812BLEDCallback(int ledno)
 {
-    return (i2c_registers[10]) | (i2c_registers[9] << 8) | (i2c_registers[8] << 16);
+    return regs.led_b | (regs.led_r << 8) | ((uint32_t)regs.led_g << 16);
 }
 
 static void adc_init(void)
@@ -73,6 +101,57 @@ static void adc_init(void)
         ;
 }
 
+static void iwdg_init(void)
+{
+    IWDG->CTLR = IWDG_WriteAccess_Enable;
+    IWDG->PSCR = IWDG_Prescaler_128;
+    IWDG->CTLR = IWDG_WriteAccess_Enable;
+    IWDG->RLDR = IWDG_TIMEOUT_MS & IWDG_RL;
+    IWDG->CTLR = CTLR_KEY_Reload;
+    IWDG->CTLR = CTLR_KEY_Enable;
+}
+
+static inline void iwdg_feed(void)
+{
+    IWDG->CTLR = CTLR_KEY_Reload;
+}
+
+static uint8_t reset_cause_get(void)
+{
+    uint32_t flags = RCC->RSTSCKR;
+    uint8_t cause = 0;
+
+    if (flags & RCC_PORRSTF) {
+        cause |= PMIC_RST_CAUSE_POR;
+    } else if (flags & RCC_IWDGRSTF) {
+        cause |= PMIC_RST_CAUSE_IWDG;
+    } else if (flags & RCC_SFTRSTF) {
+        cause |= PMIC_RST_CAUSE_SW;
+    } else if (flags & RCC_PINRSTF) {
+        cause |= PMIC_RST_CAUSE_PIN;
+    }
+
+    RCC->RSTSCKR |= RCC_RMVF;
+    return cause;
+}
+
+static void host_power_cycle(void)
+{
+    trace("Host heartbeat lost, power cycle \r\n");
+    GPIOD->OUTDR &= ~(1 << ENA_PIN);
+    for (int i = 0; i < PWR_CYCLE_OFF_MS; i += 100) {
+        Delay_Ms(100);
+        iwdg_feed();
+    }
+    GPIOD->OUTDR |= (1 << ENA_PIN);
+
+    // Disarmed until the host daemon comes up again, tm counts the new host uptime
+    regs.hb_limit = 0;
+    regs.rst_cause |= PMIC_RST_CAUSE_HB;
+    regs.pwr_on_src = PMIC_PWR_ON_SRC_HB;
+    regs.tm = 0;
+}
+
 uint16_t adc_get(void)
 {
     ADC1->CTLR2 |= ADC_SWSTART;
@@ -81,10 +160,180 @@ uint16_t adc_get(void)
     return ADC1->RDATAR;
 }
 
+static inline uint8_t btn_pressed(void)
+{
+    return (GPIOD->INDR & (1 << BTN_PIN)) == 0;
+}
+
+// TP4056 pulls CHRG low while charging and STDBY low when done, both float without input
+static inline uint8_t charger_present(void)
+{
+    return (GPIOD->INDR & ((1 << TP4056_CHRG_PIN) | (1 << TP4056_STDBY_PIN))) !=
+           ((1 << TP4056_CHRG_PIN) | (1 << TP4056_STDBY_PIN));
+}
+
+static void led_set(uint8_t r, uint8_t g, uint8_t b)
+{
+    regs.led_r = r;
+    regs.led_g = g;
+    regs.led_b = b;
+    WS2812BDMAStart(PMIC_LED_COUNT);
+}
+
+// Battery recovered or charger plugged in before the deadline, the host keeps running
+static void bat_low_cancel(void)
+{
+    trace("Shutdown request withdrawn \r\n");
+    regs.in_state.bat_low = 0;
+    regs.in_state.sd_req = 0;
+    regs.sd_deadline = 0;
+}
+
+/*
+ * Wait while the host is off until the power-on policy lets it up.
+ * A host that asked to be turned off only comes back on the button or on a
+ * fresh charger insertion, battery and always-on policies do not apply to it.
+ */
+static uint8_t wait_power_on(uint8_t off_reason)
+{
+    uint8_t charger_was = off_reason == OFF_REASON_BOOT ? 0 : charger_present();
+    uint8_t charger_edge = 0;
+    uint16_t adc = BAT_ON_ADC_THRESH;
+    uint32_t tm = 0;
+
+    led_set(0, 0, 0);
+    while (1) {
+        uint8_t policy = regs.pwr_policy;
+        uint8_t charger = charger_present();
+
+        if ((tm % OFF_ADC_INT) == 0) {
+            adc = adc_get();
+        }
+
+        if (btn_pressed()) {
+            return PMIC_PWR_ON_SRC_BUTTON;
+        }
+
+        // An insertion is kept until the charger is removed, the cell may still have to recover
+        if (charger && !charger_was) {
+            charger_edge = 1;
+        } else if (!charger) {
+            charger_edge = 0;
+        }
+
+        if (policy == PMIC_PWR_POLICY_CHARGER && charger_edge && adc >= BAT_LOW_ADC_THRESH) {
+            return PMIC_PWR_ON_SRC_CHARGER;
+        }
+
+        if (off_reason != OFF_REASON_HOST) {
+            if (policy == PMIC_PWR_POLICY_BATTERY && adc >= BAT_ON_ADC_THRESH) {
+                return PMIC_PWR_ON_SRC_BATTERY;
+            }
+            if (policy == PMIC_PWR_POLICY_ALWAYS && adc >= BAT_ON_ADC_THRESH) {
+                return PMIC_PWR_ON_SRC_ALWAYS;
+            }
+        }
+
+        charger_was = charger;
+        Delay_Ms(OFF_POLL_MS);
+        iwdg_feed();
+        tm += OFF_POLL_MS;
+    }
+}
+
+/*
+ * Serve the running host, returns once ENA has been dropped.
+ */
+static uint8_t run_host(void)
+{
+    uint8_t hb_last = 0;
+    uint8_t hb_missed = 0;
+    uint8_t low_samples = 0;
+
+    while (1) {
+        if (host_off_req) {
+            host_off_req = 0;
+            // An acknowledged low battery request is still a battery shutdown
+            return regs.in_state.sd_req ? OFF_REASON_BATTERY : OFF_REASON_HOST;
+        }
+
+        if (regs.led_upd > 0) {
+            trace("Update color \r\n");
+            WS2812BDMAStart(PMIC_LED_COUNT);
+            regs.led_upd = 0;
+        } else if ((regs.tm % ADC_MEAS_INT) == 0) {
+            regs.adc = adc_get();
+            trace("Measure voltage: %d \r\n", regs.adc);
+
+            // Ask the host to shut down once the voltage stays low and nothing charges the cell,
+            // it acks by writing PMIC_OFF_SHUTDOWN
+            if (regs.adc >= BAT_LOW_ADC_THRESH) {
+                low_samples = 0;
+                if (regs.in_state.sd_req && regs.adc >= BAT_LOW_ADC_CLEAR) {
+                    bat_low_cancel();
+                }
+            } else if (low_samples < BAT_LOW_SAMPLES) {
+                low_samples++;
+            }
+            if (low_samples == BAT_LOW_SAMPLES && !regs.in_state.sd_req && !charger_present()) {
+                regs.in_state.bat_low = 1;
+                regs.in_state.sd_req = 1;
+                regs.sd_deadline = BAT_LOW_SH_TIME;
+                trace("Device will shutdown in: %d sec \r\n", BAT_LOW_SH_TIME);
+            }
+        } else {
+            Delay_Ms(1);
+        }
+
+        regs.in_state.charge = (GPIOD->INDR & (1 << TP4056_CHRG_PIN)) > 0;
+        regs.in_state.stdby = (GPIOD->INDR & (1 << TP4056_STDBY_PIN)) > 0;
+        regs.in_state.lte = (GPIOA->INDR & (1 << LTE_LED_PIN)) > 0;
+        regs.in_state.pwr = (GPIOD->INDR & (1 << BTN_PIN)) > 0;
+
+        // Keep a press visible to a host that polls slower than the press lasts
+        if (in_state_read) {
+            in_state_read = 0;
+            regs.in_state.pwr_evt = 0;
+        }
+        if (!regs.in_state.pwr) {
+            regs.in_state.pwr_evt = 1;
+        }
+
+        if (regs.in_state.sd_req && (regs.tm % 1000) == 0) {
+            if (charger_present()) {
+                bat_low_cancel();
+            } else if (regs.sd_deadline == 0) {
+                trace("Shutdown not acknowledged, cut power \r\n");
+                GPIOD->OUTDR &= ~(1 << ENA_PIN);
+                return OFF_REASON_BATTERY;
+            } else {
+                regs.sd_deadline--;
+            }
+        }
+
+        if ((regs.tm % HB_CHECK_INT) == 0 && regs.hb_limit > 0) {
+            if (regs.hb != hb_last) {
+                hb_last = regs.hb;
+                hb_missed = 0;
+            } else if (++hb_missed >= regs.hb_limit) {
+                host_power_cycle();
+                hb_missed = 0;
+                continue;
+            }
+        }
+
+        iwdg_feed();
+
+        regs.tm += 1;
+    }
+}
+
 int main()
 {
     SystemInit();
     funGpioInitAll();
+    uint8_t rst_cause = reset_cause_get();
+    iwdg_init();
 
     // Enable GPIOs
     RCC->APB2PCENR |= RCC_APB2Periph_GPIOD | RCC_APB2Periph_GPIOC;
@@ -107,76 +356,63 @@ int main()
     GPIOD->CFGLR &= ~(0xf << (4 * ENA_PIN));
     GPIOD->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP) << (4 * ENA_PIN);
     WS2812BDMAInit();
-    i2c_registers[I2C_REG_LED_R] = 0xff;
-    i2c_registers[I2C_REG_LED_G] = 0xff;
-    i2c_registers[I2C_REG_LED_B] = 0xff;
-    WS2812BDMAStart(1);
+    led_set(0xff, 0xff, 0xff);
 
-    Delay_Ms(1000);
-    GPIOD->OUTDR |= (1 << ENA_PIN); // Turn on dev
-
-    funPinMode(PA2, GPIO_CFGLR_OUT_10Mhz_PP);    // LED
     funPinMode(PC1, GPIO_CFGLR_OUT_10Mhz_AF_OD); // SDA
     funPinMode(PC2, GPIO_CFGLR_OUT_10Mhz_AF_OD); // SCL
 
-    SetupI2CSlave(I2C_DEV_ADDR, i2c_registers,
-                  sizeof(i2c_registers), onWrite, NULL, false);
+    SetupI2CSlave(PMIC_I2C_ADDR, (volatile uint8_t *)&regs,
+                  sizeof(regs), onWrite, onRead, false);
 
     adc_init();
 
-    uint32_t *tm_reg = (uint32_t *)&i2c_registers[I2C_REG_TM];
-    while ((GPIOD->INDR & (1 << BTN_PIN)) == 0) {
-        if ((*tm_reg % ADC_MEAS_INT) >= 1000) {
-            i2c_registers[I2C_REG_LED_R] = 0x40;
-            i2c_registers[I2C_REG_LED_G] = 0x00;
-            i2c_registers[I2C_REG_LED_B] = 0x40;
-            WS2812BDMAStart(1);
-        }
-        Delay_Ms(50);
-        (*tm_reg) += 50;
-    }
+#if PMIC_BOOT_DELAY_MS > 0
+    Delay_Ms(PMIC_BOOT_DELAY_MS);
+#endif
 
-    memset(i2c_registers, 0, sizeof(i2c_registers));
-    memcpy(&i2c_registers[I2C_REG_UID], (uint8_t*) &ESIG->UID0, sizeof(uint32_t) * 3);
-    i2c_registers[I2C_REG_LED_R] = 0x30;
-    i2c_registers[I2C_REG_LED_G] = 0x20;
-    i2c_registers[I2C_REG_LED_B] = 0x10;
-    i2c_registers[I2C_REG_LED_UPD] = 1;
-    printf("Started! \r\n");
-    uint8_t low_voltage_counter = BAT_LOW_SH_TIME;
+    uint8_t off_reason = OFF_REASON_BOOT;
+    regs.pwr_policy = PMIC_PWR_POLICY;
+    regs.version = PMIC_PROTO_VERSION;
+    regs.caps = PMIC_CAPS;
 
     while (1) {
-        in_state_t *in_state = (in_state_t *)&i2c_registers[I2C_REG_IN_STATE];
-
-        if (i2c_registers[I2C_REG_LED_UPD] > 0) {
-            printf("Update color \r\n");
-            WS2812BDMAStart(1);
-            i2c_registers[I2C_REG_LED_UPD] = 0;
-        } else if ((*tm_reg % ADC_MEAS_INT) == 0) {
-            uint16_t *val = ((uint16_t *)&i2c_registers[I2C_REG_ADC]);
-            *val = adc_get();
-            printf("Measure voltage: %d \r\n", *val);
-
-            if (*val < BAT_LOW_ADC_THRESH) {
-                low_voltage_counter -= 1;
-                in_state->bat_low = 1;
-                printf("Device will shutdown in: %d sec \r\n",
-                       (low_voltage_counter * ADC_MEAS_INT) / 1000);
-                if (low_voltage_counter == 0) {
-                    GPIOD->OUTDR &= ~(1 << ENA_PIN);
-                }
-            } else {
-                low_voltage_counter = BAT_LOW_SH_TIME;
-            }
+        uint8_t pwr_on_src;
+
+        // A PMIC watchdog reset must not take the host down with it
+        if (rst_cause & PMIC_RST_CAUSE_IWDG) {
+            pwr_on_src = PMIC_PWR_ON_SRC_IWDG;
         } else {
-            Delay_Ms(1);
+            pwr_on_src = wait_power_on(off_reason);
+        }
+        GPIOD->OUTDR |= (1 << ENA_PIN); // Turn on dev
+        host_off_req = 0;
+
+        // Hold while the button is still down, show purple if held for long
+        for (uint32_t tm = 0; btn_pressed(); tm += 50) {
+            if (tm == 1000) {
+                led_set(0x40, 0x00, 0x40);
+            }
+            Delay_Ms(50);
+            iwdg_feed();
         }
 
-        in_state->charge = (GPIOD->INDR & (1 << TP4056_CHRG_PIN)) > 0;
-        in_state->stdby = (GPIOD->INDR & (1 << TP4056_STDBY_PIN)) > 0;
-        in_state->lte = (GPIOA->INDR & (1 << LTE_LED_PIN)) > 0;
-        in_state->pwr = (GPIOD->INDR & (1 << BTN_PIN)) > 0;
+        // tm restarts, so it counts the host uptime from here on
+        uint8_t policy = regs.pwr_policy;
+        memset(&regs, 0, sizeof(regs));
+        memcpy(regs.uid, (uint8_t*) &ESIG->UID0, sizeof(regs.uid));
+        regs.led_r = 0x30;
+        regs.led_g = 0x20;
+        regs.led_b = 0x10;
+        regs.led_upd = 1;
+        regs.rst_cause = rst_cause;
+        regs.pwr_policy = policy;
+        regs.pwr_on_src = pwr_on_src;
+        regs.version = PMIC_PROTO_VERSION;
+        regs.caps = PMIC_CAPS;
+        trace("Started! \r\n");
 
-        (*tm_reg) += 1;
+        off_reason = run_host();
+        rst_cause = 0;
+        trace("Host off, reason %d \r\n", off_reason);
     }
 }
@@ -0,0 +1,285 @@
+/*
+ * bench.c - PMIC link benchmark
+ *
+ * Times the transactions the daemon issues, one at a time with nothing
+ * else on the bus: single register reads, burst reads of 1..32 registers
+ * and LED updates, both the write itself and the time until the firmware
+ * has applied it and cleared led_upd. Works on anything that answers
+ * like the PMIC on an i2c-dev bus, so firmware versions, bus clocks and
+ * kernel drivers compare with the same numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "pmic_regs.h"
+
+/* Burst sizes, the whole register map at most */
+static const uint8_t burst_sizes[] = {1, 2, 4, 8, 16, 32};
+
+struct bench_result
+{
+    char name[16];
+    uint32_t bytes;    /* Payload per transfer, 0 - not a throughput test */
+    uint32_t count;    /* Successful samples */
+    uint32_t errors;
+    int na;            /* Not measurable on this bus */
+    uint32_t *samples; /* ns */
+};
+
+int bench_parse(int argc, char *argv[], struct bench_opts *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->iterations = BENCH_ITERATIONS;
+    opts->addr = -1;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            opts->json = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            long n = strtol(argv[++i], NULL, 0);
+            if (n <= 0 || n > 1000000) {
+                return -1;
+            }
+            opts->iterations = n;
+        } else if (strcmp(argv[i], "--bus") == 0 && i + 1 < argc) {
+            opts->bus = argv[++i];
+        } else if (strcmp(argv[i], "--addr") == 0 && i + 1 < argc) {
+            opts->addr = strtol(argv[++i], NULL, 0);
+            if (opts->addr < 0x08 || opts->addr > 0x77) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Monotonic ns, an emulated bus answers well within a microsecond */
+static uint64_t bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_xfer(struct I2cDevice *dev, uint8_t reg, int write, uint8_t *buf, size_t len)
+{
+    struct i2c_xfer xfer = {.reg = reg, .write = write, .buf = buf, .len = len};
+    return i2c_batch(dev, &xfer, 1);
+}
+
+static void bench_add(struct bench_result *r, uint64_t start, int rc)
+{
+    if (rc < 0) {
+        r->errors++;
+        return;
+    }
+    r->samples[r->count++] = bench_ns() - start;
+}
+
+static void bench_read(struct I2cDevice *dev, struct bench_result *r, uint32_t n, uint8_t reg, size_t len)
+{
+    uint8_t buf[I2C_XFER_MAX];
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t start = bench_ns();
+        bench_add(r, start, bench_xfer(dev, reg, 0, buf, len));
+    }
+}
+
+/*
+ * Rewrites the current colour, so the LED does not flicker. The commit is
+ * n/a where nothing clears led_upd: on i2c-stub, which only stores bytes,
+ * or when the very first commit times out.
+ */
+static void bench_led(struct I2cDevice *dev, struct bench_result *write, struct bench_result *commit,
+                      uint32_t n)
+{
+    uint8_t led[4];
+
+    commit->na = dev->ops->prefix && strcmp(dev->ops->prefix, "stub:") == 0;
+    if (bench_xfer(dev, PMIC_REG_LED_G, 0, led, 3) < 0) {
+        write->errors += n;
+        commit->errors += commit->na ? 0 : n;
+        return;
+    }
+    led[3] = 1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t start = bench_ns();
+        int rc = bench_xfer(dev, PMIC_REG_LED_G, 1, led, sizeof(led));
+        bench_add(write, start, rc);
+        if (commit->na) {
+            continue;
+        }
+        if (rc < 0) {
+            commit->errors++;
+            continue;
+        }
+
+        /* The firmware clears led_upd once the WS2812 transfer started */
+        uint8_t upd = 1;
+        while (rc >= 0 && upd && bench_ns() - start < BENCH_COMMIT_TIMEOUT * 1000ull) {
+            rc = bench_xfer(dev, PMIC_REG_LED_UPD, 0, &upd, 1);
+        }
+        if (rc >= 0 && upd && !commit->count && !commit->errors) {
+            commit->na = 1;
+            continue;
+        }
+        bench_add(commit, start, upd ? -1 : rc);
+    }
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank in us, samples sorted */
+static double bench_pct(const struct bench_result *r, unsigned int permille)
+{
+    uint64_t rank = ((uint64_t)r->count * permille + 999) / 1000;
+    return r->samples[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static uint64_t bench_sum(const struct bench_result *r)
+{
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < r->count; i++) {
+        sum += r->samples[i];
+    }
+    return sum;
+}
+
+static void bench_print_text(const struct bench_result *res, size_t n)
+{
+    printf("%-12s %8s %6s %9s %9s %9s %9s %9s %9s %10s\n", "test", "ok", "errors", "min", "p50", "p90",
+           "p99", "max", "mean", "bytes/s");
+    for (size_t i = 0; i < n; i++) {
+        const struct bench_result *r = &res[i];
+        if (r->na) {
+            printf("%-12s %8s\n", r->name, "n/a");
+            continue;
+        }
+        printf("%-12s %8u %6u", r->name, r->count, r->errors);
+        if (!r->count) {
+            printf("\n");
+            continue;
+        }
+        uint64_t sum = bench_sum(r);
+        printf(" %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f", bench_pct(r, 0), bench_pct(r, 500), bench_pct(r, 900),
+               bench_pct(r, 990), bench_pct(r, 1000), sum / 1000.0 / r->count);
+        if (r->bytes && sum) {
+            printf(" %10.0f", (double)r->bytes * r->count * 1e9 / sum);
+        }
+        printf("\n");
+    }
+    printf("(latencies in us)\n");
+}
+
+static void bench_print_json(const struct bench_result *res, size_t n, const struct I2cDevice *dev,
+                             uint32_t iterations)
+{
+    printf("{\n");
+    printf("  \"bus\": \"%s\",\n", dev->filename);
+    printf("  \"addr\": %u,\n", dev->addr);
+    printf("  \"iterations\": %u,\n", iterations);
+    printf("  \"tests\": {\n");
+    for (size_t i = 0; i < n; i++) {
+        const struct bench_result *r = &res[i];
+        uint32_t total = r->count + r->errors;
+
+        printf("    \"%s\": {\n", r->name);
+        if (r->na) {
+            printf("      \"available\": false\n    }%s\n", i + 1 < n ? "," : "");
+            continue;
+        }
+        printf("      \"ok\": %u,\n", r->count);
+        printf("      \"errors\": %u,\n", r->errors);
+        printf("      \"error_rate\": %.6f", total ? (double)r->errors / total : 0.0);
+        if (r->count) {
+            uint64_t sum = bench_sum(r);
+            printf(",\n      \"min_us\": %.1f,\n", bench_pct(r, 0));
+            printf("      \"p50_us\": %.1f,\n", bench_pct(r, 500));
+            printf("      \"p90_us\": %.1f,\n", bench_pct(r, 900));
+            printf("      \"p99_us\": %.1f,\n", bench_pct(r, 990));
+            printf("      \"max_us\": %.1f,\n", bench_pct(r, 1000));
+            printf("      \"mean_us\": %.1f", sum / 1000.0 / r->count);
+            if (r->bytes && sum) {
+                printf(",\n      \"bytes_per_s\": %.0f", (double)r->bytes * r->count * 1e9 / sum);
+            }
+        }
+        printf("\n    }%s\n", i + 1 < n ? "," : "");
+    }
+    printf("  }\n");
+    printf("}\n");
+}
+
+int run_bench(struct I2cDevice *dev, const struct bench_opts *opts)
+{
+    enum
+    {
+        N_READ = 1,
+        N_BURST = sizeof(burst_sizes),
+        N_TESTS = N_READ + N_BURST + 2,
+    };
+    struct bench_result res[N_TESTS];
+    uint32_t n = opts->iterations;
+    uint32_t ok = 0;
+    int ret = 0;
+
+    memset(res, 0, sizeof(res));
+    for (int i = 0; i < N_TESTS; i++) {
+        if (!(res[i].samples = malloc(n * sizeof(uint32_t)))) {
+            fprintf(stderr, "Out of memory for %u samples\n", n);
+            while (i-- > 0) {
+                free(res[i].samples);
+            }
+            return -1;
+        }
+    }
+
+    snprintf(res[0].name, sizeof(res[0].name), "read");
+    bench_read(dev, &res[0], n, PMIC_REG_VERSION, 1);
+
+    for (int i = 0; i < N_BURST; i++) {
+        struct bench_result *r = &res[N_READ + i];
+        snprintf(r->name, sizeof(r->name), "burst-%u", burst_sizes[i]);
+        r->bytes = burst_sizes[i];
+        bench_read(dev, r, n, 0, burst_sizes[i]);
+    }
+
+    struct bench_result *write = &res[N_READ + N_BURST];
+    struct bench_result *commit = write + 1;
+    snprintf(write->name, sizeof(write->name), "led-write");
+    snprintf(commit->name, sizeof(commit->name), "led-commit");
+    bench_led(dev, write, commit, n);
+
+    for (int i = 0; i < N_TESTS; i++) {
+        qsort(res[i].samples, res[i].count, sizeof(uint32_t), bench_cmp);
+        ok += res[i].count;
+    }
+
+    if (opts->json) {
+        bench_print_json(res, N_TESTS, dev, n);
+    } else {
+        bench_print_text(res, N_TESTS);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "No transfer succeeded\n");
+        ret = -1;
+    }
+    for (int i = 0; i < N_TESTS; i++) {
+        free(res[i].samples);
+    }
+    return ret;
+}
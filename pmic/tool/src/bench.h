@@ -0,0 +1,33 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+
+#include "i2c.h"
+
+/* Iterations per test unless -n says otherwise */
+#define BENCH_ITERATIONS 1000
+
+/* Longest wait for the firmware to apply an LED update, us */
+#define BENCH_COMMIT_TIMEOUT 100000
+
+struct bench_opts
+{
+    uint32_t iterations;
+    int json;
+    const char *bus; /* NULL - from /etc/config/pmic */
+    int addr;        /* -1 - from /etc/config/pmic */
+};
+
+/* Parse `pmicctrl bench` arguments, -1 on bad ones */
+int bench_parse(int argc, char *argv[], struct bench_opts *opts);
+
+/*
+ * Time single register reads, burst reads of 1..32 registers and LED
+ * write+commit cycles, then print percentiles and error rates as text or
+ * JSON. The LED keeps its colour; led-commit is n/a on a bus where nothing
+ * clears led_upd. Returns -1 if no transfer succeeded.
+ */
+int run_bench(struct I2cDevice *dev, const struct bench_opts *opts);
+
+#endif
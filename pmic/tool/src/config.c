@@ -0,0 +1,155 @@
+/*
+ * config.c - Daemon settings from UCI
+ *
+ *   config daemon 'daemon'
+ *       option bus               '/dev/i2c-0'
+ *       option addr              '0x09'
+ *       option trace             '/tmp/pmic.trace'   # see trace.h
+ *       option status_fast       '100'    # ms
+ *       option status_low        '250'
+ *       option status_idle       '1000'
+ *       option battery_interval  '5000'
+ *       option battery_fast      '1000'
+ *       option register_interval '5000'
+ *       option heartbeat_limit   '60'     # s without a heartbeat until a power-cycle
+ *       option vref              '3.3'
+ *       option div_ratio         '2.0'
+ *
+ * LED colours are set by the `config rule` sections, see rules.c. Bad
+ * values are reported and replaced by their default.
+ */
+
+#include <libubox/utils.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uci.h>
+
+#include "config.h"
+#include "daemon.h"
+
+static struct pmic_config g_config;
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} config_intervals[] = {
+    {"status_fast", offsetof(struct pmic_config, status_fast)},
+    {"status_low", offsetof(struct pmic_config, status_low)},
+    {"status_idle", offsetof(struct pmic_config, status_idle)},
+    {"battery_interval", offsetof(struct pmic_config, battery_interval)},
+    {"battery_fast", offsetof(struct pmic_config, battery_fast)},
+    {"register_interval", offsetof(struct pmic_config, register_interval)},
+};
+
+static void config_defaults(struct pmic_config *c)
+{
+    memset(c, 0, sizeof(*c));
+    snprintf(c->bus, sizeof(c->bus), "%s", I2C_BUS);
+    c->addr = PMIC_I2C_ADDR;
+    c->status_fast = STATUS_POLL_FAST;
+    c->status_low = STATUS_POLL_LOW;
+    c->status_idle = STATUS_POLL_IDLE;
+    c->battery_interval = VBAT_POLL_INTERVAL;
+    c->battery_fast = VBAT_POLL_FAST;
+    c->register_interval = TELEMETRY_POLL_INTERVAL;
+    c->heartbeat_limit = HEARTBEAT_MISSED_LIMIT;
+    c->vref = VREF;
+    c->div_ratio = DIV_RATIO;
+}
+
+/* Parse @opt into @value if it is within [min, max] */
+static int config_float(const char *name, const char *opt, float min, float max, float *value)
+{
+    char *end;
+    float v = strtof(opt, &end);
+
+    if (end == opt || *end || v < min || v > max) {
+        fprintf(stderr, "config: bad %s '%s'\n", name, opt);
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+static int config_ulong(const char *name, const char *opt, unsigned long min, unsigned long max,
+                        unsigned long *value)
+{
+    char *end;
+    unsigned long v = strtoul(opt, &end, 0);
+
+    if (end == opt || *end || v < min || v > max) {
+        fprintf(stderr, "config: bad %s '%s'\n", name, opt);
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+static void config_parse(struct uci_context *ctx, struct uci_section *s, struct pmic_config *c)
+{
+    const char *opt;
+    unsigned long v;
+
+    if ((opt = uci_lookup_option_string(ctx, s, "bus"))) {
+        snprintf(c->bus, sizeof(c->bus), "%s", opt);
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "trace"))) {
+        snprintf(c->trace, sizeof(c->trace), "%s", opt);
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "addr")) && config_ulong("addr", opt, 0x08, 0x77, &v) == 0) {
+        c->addr = v;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(config_intervals); i++) {
+        opt = uci_lookup_option_string(ctx, s, config_intervals[i].name);
+        if (opt && config_ulong(config_intervals[i].name, opt, CONFIG_INTERVAL_MIN, CONFIG_INTERVAL_MAX, &v) == 0) {
+            *(uint32_t *)((uint8_t *)c + config_intervals[i].offset) = v;
+        }
+    }
+
+    if ((opt = uci_lookup_option_string(ctx, s, "heartbeat_limit")) &&
+        config_ulong("heartbeat_limit", opt, CONFIG_HB_LIMIT_MIN, CONFIG_HB_LIMIT_MAX, &v) == 0) {
+        c->heartbeat_limit = v;
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "vref"))) {
+        config_float("vref", opt, 1.0f, 5.5f, &c->vref);
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "div_ratio"))) {
+        config_float("div_ratio", opt, 1.0f, 10.0f, &c->div_ratio);
+    }
+}
+
+int config_load(void)
+{
+    struct uci_context *ctx = uci_alloc_context();
+    struct uci_package *pkg = NULL;
+    struct uci_element *e;
+    struct pmic_config c;
+
+    config_defaults(&c);
+    if (ctx && uci_load(ctx, "pmic", &pkg) == 0) {
+        uci_foreach_element(&pkg->sections, e) {
+            struct uci_section *s = uci_to_section(e);
+            if (strcmp(s->type, "daemon") == 0) {
+                config_parse(ctx, s, &c);
+                break;
+            }
+        }
+        uci_unload(ctx, pkg);
+    }
+    if (ctx) {
+        uci_free_context(ctx);
+    }
+
+    c.adc_full_mv = (uint32_t)(c.div_ratio * c.vref * 1000.0f + 0.5f);
+    g_config = c;
+    return 0;
+}
+
+const struct pmic_config *config_get(void)
+{
+    return &g_config;
+}
@@ -0,0 +1,43 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stdint.h>
+
+/*
+ * Daemon settings from the `config daemon` section of /etc/config/pmic,
+ * the compiled-in values of daemon.h fill in anything missing.
+ */
+struct pmic_config
+{
+    char bus[64];               /* I2C bus device, start only */
+    uint16_t addr;              /* PMIC address, start only */
+    char trace[64];             /* Capture of all bus traffic, start only, "" - off */
+    uint32_t status_fast;       /* ms, button held or recent activity */
+    uint32_t status_low;        /* ms, battery close to the shutdown threshold */
+    uint32_t status_idle;       /* ms, nothing happening */
+    uint32_t battery_interval;  /* ms */
+    uint32_t battery_fast;      /* ms, below VBAT_NEAR_LOW_ADC */
+    uint32_t register_interval; /* ms, registers only kept in the mirror */
+    uint8_t heartbeat_limit;    /* Missed heartbeats before the PMIC power-cycles the host */
+    float vref;                 /* ADC reference, V */
+    float div_ratio;            /* Battery divider */
+    uint32_t adc_full_mv;       /* Battery mV at ADC_MAX, from vref and div_ratio */
+};
+
+/* Shortest accepted poll interval, ms */
+#define CONFIG_INTERVAL_MIN 20
+
+/* Longest accepted poll interval, ms */
+#define CONFIG_INTERVAL_MAX 3600000
+
+/* Accepted heartbeat_limit, the PMIC checks once a second; below it a busy host gets power-cycled */
+#define CONFIG_HB_LIMIT_MIN 10
+#define CONFIG_HB_LIMIT_MAX 255
+
+/* (Re)load /etc/config/pmic, a missing file or section keeps the defaults */
+int config_load(void);
+
+/* Settings in effect */
+const struct pmic_config *config_get(void);
+
+#endif
@@ -5,29 +5,93 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "config.h"
 #include "daemon.h"
+#include "events.h"
+#include "forecast.h"
+#include "history.h"
+#include "i2cq.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "poll.h"
+#include "rules.h"
+#include "shm.h"
+#include "telemetry.h"
 #include "ubus.h"
 
 /* Global pointer to the I2C device (used in callbacks) */
 static struct I2cDevice *g_dev = NULL;
 
-int set_led_color(struct I2cDevice *dev, uint8_t r, uint8_t g, uint8_t b);
-int shutdown_device(struct I2cDevice *dev);
+/* Capabilities of the attached PMIC firmware, 0 for legacy firmware */
+static uint8_t g_caps = 0;
 
-typedef union
+/* --- Queued Register Writes --- */
+static void write_done(struct i2cq_job *job)
 {
-    uint8_t raw;
-    struct
-    {
-        uint8_t charge : 1;
-        uint8_t stdby : 1;
-        uint8_t lte : 1;
-        uint8_t pwr : 1;
-        uint8_t bat_low : 1;
-        uint8_t : 3;
-    };
-} pmic_state_t;
+    struct ubus_request_data *req = job->priv;
+
+    if (job->rc == 0) {
+        for (size_t i = 0; i < job->count; i++) {
+            mirror_store(job->xfers[i].reg, job->xfers[i].buf, job->xfers[i].len);
+        }
+        shm_publish();
+    } else {
+        fprintf(stderr, "Failed to write PMIC register %u\n", job->xfers[0].reg);
+    }
+
+    if (req) {
+        ubus_complete_deferred_request(pmicctrl_handler_get_context(), req,
+                                       job->rc == 0 ? UBUS_STATUS_OK : UBUS_STATUS_UNKNOWN_ERROR);
+        free(req);
+    }
+}
+
+/*
+ * Queue a register write on the I2C worker. With a request the ubus reply
+ * is deferred until the write is done, otherwise it is fire and forget.
+ */
+static int queue_write(uint8_t prio, uint8_t reg, const void *data, uint8_t len,
+                       struct ubus_context *ctx, struct ubus_request_data *req)
+{
+    struct i2cq_job *job = i2cq_job_new(prio, write_done, NULL);
+    struct ubus_request_data *dreq = NULL;
+
+    if (!job) {
+        return UBUS_STATUS_NO_MEMORY;
+    }
+    if (req && !(dreq = calloc(1, sizeof(*dreq)))) {
+        free(job);
+        return UBUS_STATUS_NO_MEMORY;
+    }
+
+    i2cq_job_add(job, reg, data, len);
+    job->coalesce = prio == I2CQ_PRIO_LED;
+    job->priv = dreq;
+    if (i2cq_submit(job) < 0) {
+        free(dreq);
+        free(job);
+        return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+
+    /* Completion is delivered through uloop, so deferring afterwards is safe */
+    if (dreq) {
+        ubus_defer_request(ctx, req, dreq);
+    }
+    return UBUS_STATUS_OK;
+}
+
+int pmic_simulated(void)
+{
+    return g_dev && g_dev->ops->simulated;
+}
+
+void pmic_led_set(uint8_t r, uint8_t g, uint8_t b)
+{
+    uint8_t data[4] = {g, r, b, 0x01};
+    queue_write(I2CQ_PRIO_LED, PMIC_REG_LED_G, data, sizeof(data), NULL, NULL);
+}
 
 /* --- LED Command Policy & Callback --- */
 enum
@@ -48,7 +112,6 @@ static int ubus_set_led(struct ubus_context *ctx, struct ubus_object *obj,
                         struct ubus_request_data *req, const char *method,
                         struct blob_attr *msg)
 {
-    (void)ctx;
     (void)obj;
     (void)req;
     (void)method;
@@ -64,26 +127,450 @@ static int ubus_set_led(struct ubus_context *ctx, struct ubus_object *obj,
     int b_val = blobmsg_get_u32(tb[LED_B]);
 
     printf("Received ubus set_led command: r=%d, g=%d, b=%d\n", r, g, b_val);
-    return set_led_color(g_dev, (uint8_t)r, (uint8_t)g, (uint8_t)b_val);
+
+    /* Lowest priority and coalesced, a burst of set_led ends with the last color */
+    uint8_t data[4] = {(uint8_t)g, (uint8_t)r, (uint8_t)b_val, 0x01};
+    return queue_write(I2CQ_PRIO_LED, PMIC_REG_LED_G, data, sizeof(data), ctx, NULL);
+}
+
+struct shutdown_sync
+{
+    struct uloop_process proc;
+    struct ubus_request_data req;
+};
+
+/* Everything is flushed, tell the PMIC it is safe to cut power now */
+static void shutdown_synced(struct uloop_process *p, int ret)
+{
+    struct shutdown_sync *s = container_of(p, struct shutdown_sync, proc);
+    struct ubus_request_data *dreq = malloc(sizeof(*dreq));
+    struct i2cq_job *job = NULL;
+    uint8_t off = PMIC_OFF_SHUTDOWN;
+
+    (void)ret;
+    if (dreq) {
+        *dreq = s->req;
+        job = i2cq_job_new(I2CQ_PRIO_URGENT, write_done, dreq);
+    }
+    if (job) {
+        i2cq_job_add(job, PMIC_REG_OFF, &off, 1);
+        if (i2cq_submit(job) == 0) {
+            printf("Shutdown command sent.\n");
+            free(s);
+            return;
+        }
+    }
+
+    ubus_complete_deferred_request(pmicctrl_handler_get_context(), &s->req,
+                                   UBUS_STATUS_UNKNOWN_ERROR);
+    free(job);
+    free(dreq);
+    free(s);
 }
 
 static int ubus_dev_shutdown(struct ubus_context *ctx, struct ubus_object *obj,
     struct ubus_request_data *req, const char *method,
     struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    /* sync() can block for seconds, run it in a child and not on uloop */
+    struct shutdown_sync *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return UBUS_STATUS_NO_MEMORY;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork for sync");
+        free(s);
+        return UBUS_STATUS_UNKNOWN_ERROR;
+    }
+    if (pid == 0) {
+        sync();
+        _exit(0);
+    }
+
+    s->proc.pid = pid;
+    s->proc.cb = shutdown_synced;
+    uloop_process_add(&s->proc);
+    ubus_defer_request(ctx, req, &s->req);
+    return UBUS_STATUS_OK;
+}
+
+
+/* --- Power-on Policy --- */
+enum
+{
+    POLICY_NAME,
+    __POLICY_MAX,
+};
+
+static const struct blobmsg_policy power_policy[__POLICY_MAX] = {
+    [POLICY_NAME] = {.name = "policy", .type = BLOBMSG_TYPE_STRING},
+};
+
+/* Indexed by the PMIC PWR_POLICY_* value */
+static const char *const power_policy_names[] = {
+    "button",
+    "charger",
+    "battery",
+    "always",
+};
+
+static int ubus_set_policy(struct ubus_context *ctx, struct ubus_object *obj,
+                           struct ubus_request_data *req, const char *method,
+                           struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+
+    struct blob_attr *tb[__POLICY_MAX];
+    blobmsg_parse(power_policy, __POLICY_MAX, tb, blobmsg_data(msg), blobmsg_len(msg));
+    if (!tb[POLICY_NAME]) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    if (!(g_caps & PMIC_CAP_PWR_POLICY)) {
+        return UBUS_STATUS_NOT_SUPPORTED;
+    }
+
+    const char *name = blobmsg_get_string(tb[POLICY_NAME]);
+    for (size_t i = 0; i < ARRAY_SIZE(power_policy_names); i++) {
+        if (strcmp(name, power_policy_names[i]) == 0) {
+            uint8_t policy = i;
+            printf("Power-on policy set to %s\n", name);
+            return queue_write(I2CQ_PRIO_POLL, PMIC_REG_PWR_POLICY, &policy, 1, ctx, req);
+        }
+    }
+    return UBUS_STATUS_INVALID_ARGUMENT;
+}
+
+/* --- Poll Plan --- */
+enum
+{
+    POLL_STATE,
+    POLL_BATTERY,
+    POLL_CLOCK,
+    POLL_LED,
+    POLL_CONFIG,
+    POLL_WATCHDOG,
+    POLL_HEARTBEAT,
+    POLL_TELEMETRY,
+    POLL_METRICS,
+    POLL_HISTORY,
+    __POLL_MAX,
+};
+
+static struct poll_group poll_plan[__POLL_MAX];
+
+/* Groups that only keep registers in the mirror, at register_interval */
+static const uint8_t register_groups[] = {POLL_CLOCK, POLL_LED, POLL_CONFIG, POLL_WATCHDOG};
+
+static void daemon_reload(void);
+
+/* --- Status from the register mirror, no bus traffic --- */
+
+/* Age reported per field, in ms since the register was read */
+static const struct
+{
+    const char *name;
+    uint8_t reg;
+} status_ages[] = {
+    {"tm", PMIC_REG_TM},
+    {"mv", PMIC_REG_ADC},
+    {"state", PMIC_REG_IN_STATE},
+    {"shutdown-deadline", PMIC_REG_SD_DEADLINE},
+    {"power-policy", PMIC_REG_PWR_POLICY},
+    {"led", PMIC_REG_LED_G},
+    {"reset-cause", PMIC_REG_RST_CAUSE},
+    {"power-on-source", PMIC_REG_PWR_ON_SRC},
+    {"heartbeat-limit", PMIC_REG_HB_LIMIT},
+};
+
+static int ubus_status(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    static struct blob_buf b;
+    const struct pmic_regs *regs = mirror_regs();
+    struct forecast forecast;
+    void *tbl;
+
+    if (mirror_age(PMIC_REG_IN_STATE) == MIRROR_AGE_NEVER) {
+        return UBUS_STATUS_NO_DATA;
+    }
+
+    blob_buf_init(&b, 0);
+    blobmsg_add_u32(&b, "version", regs->version);
+    blobmsg_add_u32(&b, "caps", regs->caps);
+    blobmsg_add_u32(&b, "tm", regs->tm);
+    blobmsg_add_u32(&b, "adc", regs->adc);
+    blobmsg_add_u32(&b, "mv", events_mv(regs->adc));
+    blobmsg_add_u32(&b, "soc", events_soc(events_mv(regs->adc)));
+    forecast_get(&forecast);
+    if (forecast.time_to_empty) {
+        blobmsg_add_u32(&b, "time-to-empty", forecast.time_to_empty);
+    }
+    if (forecast.time_to_full) {
+        blobmsg_add_u32(&b, "time-to-full", forecast.time_to_full);
+    }
+    blobmsg_add_u32(&b, "confidence", forecast.confidence);
+    blobmsg_add_u32(&b, "soc-rate", forecast.rate);
+    blobmsg_add_u8(&b, "charge", !regs->in_state.charge);
+    blobmsg_add_u8(&b, "standby", !regs->in_state.stdby);
+    blobmsg_add_u8(&b, "lte", regs->in_state.lte);
+    blobmsg_add_u8(&b, "power", !regs->in_state.pwr);
+    blobmsg_add_u8(&b, "battery-low", regs->in_state.bat_low);
+    blobmsg_add_u8(&b, "shutdown-request", regs->in_state.sd_req);
+    blobmsg_add_u32(&b, "shutdown-deadline", regs->sd_deadline);
+    if (regs->pwr_policy < ARRAY_SIZE(power_policy_names)) {
+        blobmsg_add_string(&b, "power-policy", power_policy_names[regs->pwr_policy]);
+    }
+    blobmsg_add_u32(&b, "power-on-source", regs->pwr_on_src);
+    blobmsg_add_u32(&b, "reset-cause", regs->rst_cause);
+    blobmsg_add_u32(&b, "heartbeat-limit", regs->hb_limit);
+    blobmsg_add_u32(&b, "poll-interval", poll_plan[POLL_STATE].interval);
+    blobmsg_add_u32(&b, "wakeups-per-minute", poll_wakeups_per_minute());
+
+    tbl = blobmsg_open_table(&b, "led");
+    blobmsg_add_u32(&b, "r", regs->led_r);
+    blobmsg_add_u32(&b, "g", regs->led_g);
+    blobmsg_add_u32(&b, "b", regs->led_b);
+    blobmsg_close_table(&b, tbl);
+
+    tbl = blobmsg_open_table(&b, "age");
+    for (size_t i = 0; i < ARRAY_SIZE(status_ages); i++) {
+        uint32_t age = mirror_age(status_ages[i].reg);
+        if (age != MIRROR_AGE_NEVER) {
+            blobmsg_add_u32(&b, status_ages[i].name, age);
+        }
+    }
+    blobmsg_close_table(&b, tbl);
+
+    ubus_send_reply(ctx, req, b.head);
+    return UBUS_STATUS_OK;
+}
+
+/* Raw register image for pmicctrl commands proxied through the daemon */
+static int ubus_regs(struct ubus_context *ctx, struct ubus_object *obj,
+                     struct ubus_request_data *req, const char *method,
+                     struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    static struct blob_buf b;
+    const uint8_t *raw = (const uint8_t *)mirror_regs();
+    char hex[PMIC_REG_COUNT * 2 + 1];
+
+    if (mirror_age(PMIC_REG_IN_STATE) == MIRROR_AGE_NEVER) {
+        return UBUS_STATUS_NO_DATA;
+    }
+
+    for (int i = 0; i < PMIC_REG_COUNT; i++) {
+        snprintf(&hex[i * 2], 3, "%02x", raw[i]);
+    }
+
+    blob_buf_init(&b, 0);
+    blobmsg_add_string(&b, "regs", hex);
+    blobmsg_add_u32(&b, "age", mirror_age(PMIC_REG_IN_STATE));
+    ubus_send_reply(ctx, req, b.head);
+    return UBUS_STATUS_OK;
+}
+
+/* --- Bus Health --- */
+static int ubus_health(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    static struct blob_buf b;
+    struct i2cq_health health;
+    void *tbl;
+
+    i2cq_health_get(&health);
+
+    blob_buf_init(&b, 0);
+    blobmsg_add_u32(&b, "jobs", health.jobs);
+    blobmsg_add_u32(&b, "failed", health.failed);
+    blobmsg_add_u32(&b, "retries", health.retries);
+    blobmsg_add_u32(&b, "recoveries", health.recoveries);
+    blobmsg_add_u32(&b, "consecutive", health.consecutive);
+    if (health.last_error) {
+        blobmsg_add_string(&b, "last-error", i2cq_err_name(i2cq_classify(health.last_error)));
+        blobmsg_add_u32(&b, "last-errno", -health.last_error);
+    }
+    if (health.last_ok) {
+        blobmsg_add_u64(&b, "last-ok-age", mirror_now() - health.last_ok);
+    }
+
+    tbl = blobmsg_open_table(&b, "errors");
+    for (int i = 0; i < __I2CQ_ERR_MAX; i++) {
+        blobmsg_add_u32(&b, i2cq_err_name(i), health.errors[i]);
+    }
+    blobmsg_close_table(&b, tbl);
+
+    /* Failed reads in a row per poll group, each doubles its interval */
+    tbl = blobmsg_open_table(&b, "backoff");
+    for (size_t i = 0; i < __POLL_MAX; i++) {
+        if (poll_plan[i].count) {
+            blobmsg_add_u32(&b, poll_plan[i].name, poll_plan[i].fails);
+        }
+    }
+    blobmsg_close_table(&b, tbl);
+
+    ubus_send_reply(ctx, req, b.head);
+    return UBUS_STATUS_OK;
+}
+
+/* --- Notification Rate --- */
+enum
+{
+    NOTIFY_TOPIC,
+    NOTIFY_INTERVAL,
+    __NOTIFY_MAX,
+};
+
+static const struct blobmsg_policy notify_policy[__NOTIFY_MAX] = {
+    [NOTIFY_TOPIC] = {.name = "topic", .type = BLOBMSG_TYPE_STRING},
+    [NOTIFY_INTERVAL] = {.name = "interval", .type = BLOBMSG_TYPE_INT32},
+};
+
+/* Minimum interval between notifications of a pmic.<topic> object, leased, see events.h */
+static int ubus_notify_interval(struct ubus_context *ctx, struct ubus_object *obj,
+                                struct ubus_request_data *req, const char *method,
+                                struct blob_attr *msg)
+{
+    (void)ctx;
+    (void)obj;
+    (void)method;
+
+    struct blob_attr *tb[__NOTIFY_MAX];
+    blobmsg_parse(notify_policy, __NOTIFY_MAX, tb, blobmsg_data(msg), blobmsg_len(msg));
+    if (!tb[NOTIFY_TOPIC] || !tb[NOTIFY_INTERVAL]) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    return events_set_interval(blobmsg_get_string(tb[NOTIFY_TOPIC]), req->peer,
+                               blobmsg_get_u32(tb[NOTIFY_INTERVAL]));
+}
+
+/* --- Metrics --- */
+static int ubus_metrics(struct ubus_context *ctx, struct ubus_object *obj,
+                        struct ubus_request_data *req, const char *method,
+                        struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+    (void)msg;
+
+    static struct blob_buf b;
+
+    blob_buf_init(&b, 0);
+    metrics_blob(&b);
+    ubus_send_reply(ctx, req, b.head);
+    return UBUS_STATUS_OK;
+}
+
+/* --- Configuration --- */
+
+/* Apply /etc/config/pmic again, called by the init script's reload */
+static int ubus_reload(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
 {
     (void)ctx;
     (void)obj;
     (void)req;
     (void)method;
     (void)msg;
-    shutdown_device(g_dev);
-    return UBUS_STATUS_OK;;
+
+    daemon_reload();
+    return UBUS_STATUS_OK;
+}
+
+/* --- Battery History --- */
+enum
+{
+    HISTORY_WINDOW,
+    __HISTORY_MAX,
+};
+
+static const struct blobmsg_policy history_policy[__HISTORY_MAX] = {
+    [HISTORY_WINDOW] = {.name = "window", .type = BLOBMSG_TYPE_INT32},
+};
+
+/* min/avg/max of the battery over the last window s, 1 h by default */
+static int ubus_history(struct ubus_context *ctx, struct ubus_object *obj,
+                        struct ubus_request_data *req, const char *method,
+                        struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+
+    static struct blob_buf b;
+    struct blob_attr *tb[__HISTORY_MAX];
+    uint32_t window = 3600;
+
+    blobmsg_parse(history_policy, __HISTORY_MAX, tb, blobmsg_data(msg), blobmsg_len(msg));
+    if (tb[HISTORY_WINDOW]) {
+        window = blobmsg_get_u32(tb[HISTORY_WINDOW]);
+    }
+    if (!window) {
+        return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    blob_buf_init(&b, 0);
+    history_blob(&b, window);
+    ubus_send_reply(ctx, req, b.head);
+    return UBUS_STATUS_OK;
 }
 
+/* Handler wrapper that records the call in the metrics */
+#define UBUS_TIMED(handler)                                                         \
+    static int handler##_timed(struct ubus_context *ctx, struct ubus_object *obj,   \
+                               struct ubus_request_data *req, const char *method,   \
+                               struct blob_attr *msg)                               \
+    {                                                                               \
+        uint64_t start = metrics_us();                                              \
+        int rc = handler(ctx, obj, req, method, msg);                               \
+        metrics_method(method, metrics_us() - start);                               \
+        return rc;                                                                  \
+    }
+
+UBUS_TIMED(ubus_status)
+UBUS_TIMED(ubus_regs)
+UBUS_TIMED(ubus_health)
+UBUS_TIMED(ubus_metrics)
+UBUS_TIMED(ubus_history)
+UBUS_TIMED(ubus_dev_shutdown)
+UBUS_TIMED(ubus_set_led)
+UBUS_TIMED(ubus_set_policy)
+UBUS_TIMED(ubus_notify_interval)
+UBUS_TIMED(ubus_reload)
 
 static const struct ubus_method pmic_methods[] = {
-    UBUS_METHOD_NOARG("shutdown", ubus_dev_shutdown),
-    UBUS_METHOD("set_led",  ubus_set_led, led_policy),
+    UBUS_METHOD_NOARG("status", ubus_status_timed),
+    UBUS_METHOD_NOARG("regs", ubus_regs_timed),
+    UBUS_METHOD_NOARG("health", ubus_health_timed),
+    UBUS_METHOD_NOARG("metrics", ubus_metrics_timed),
+    UBUS_METHOD("history", ubus_history_timed, history_policy),
+    UBUS_METHOD_NOARG("shutdown", ubus_dev_shutdown_timed),
+    UBUS_METHOD("set_led",  ubus_set_led_timed, led_policy),
+    UBUS_METHOD("set_policy", ubus_set_policy_timed, power_policy),
+    UBUS_METHOD("notify_interval", ubus_notify_interval_timed, notify_policy),
+    UBUS_METHOD_NOARG("reload", ubus_reload_timed),
 };
 
 static struct ubus_object_type pmic_object_type =
@@ -97,172 +584,461 @@ static struct ubus_object pmic_object = {
 };
 
 /* --- Polling Callback Example --- */
-static pmic_state_t current_state;
-static unsigned int pressed_count = 0;
+static pmic_in_state_t current_state;
+static uint64_t pressed_since = 0;
+static uint64_t last_activity = 0;
 
-static void blobmsg_add_float(struct blob_buf *buffer, const char *name, float value)
+/*
+ * Send the changes collected so far as one event. Rules of the rate
+ * limited charger pins follow the event, not the raw pin.
+ */
+static void event_flush(void)
 {
-    char tmp[64];
-    snprintf(tmp, sizeof(tmp), "%.4f", value);
-    blobmsg_add_string(buffer, name, tmp);
+    static uint32_t failed = 0;
+    static uint32_t recoveries = 0;
+    struct i2cq_health health;
+
+    i2cq_health_get(&health);
+    if (health.failed != failed) {
+        failed = health.failed;
+        events_set(EVENT_BUS_FAILED, failed);
+    }
+    if (health.recoveries != recoveries) {
+        recoveries = health.recoveries;
+        events_set(EVENT_BUS_RECOVERIES, recoveries);
+    }
+
+    uint32_t sent = events_flush();
+
+    if (sent & EVENT_BIT(EVENT_CHARGE)) {
+        rules_fire(RULE_EV_CHARGE, events_get(EVENT_CHARGE));
+    }
+    if (sent & EVENT_BIT(EVENT_STANDBY)) {
+        rules_fire(RULE_EV_STANDBY, events_get(EVENT_STANDBY));
+    }
 }
 
-static void power_btn_hnd(pmic_state_t *state)
+static void power_btn_hnd(pmic_in_state_t *state)
 {
-    static struct blob_buf b;
+    uint64_t now = mirror_now();
+
     if (state->pwr != current_state.pwr) {
-        blob_buf_init(&b, 0);
-        blobmsg_add_u32(&b, "power", !state->pwr);
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
-        }
+        events_set(EVENT_POWER, !state->pwr);
+        rules_fire(RULE_EV_POWER, !state->pwr);
+    } else if ((g_caps & PMIC_CAP_BTN_LATCH) && state->pwr_evt && state->pwr) {
+        /* Pressed and released between two idle polls, the PMIC latched it */
+        events_set(EVENT_TAP, 1);
+        rules_fire(RULE_EV_POWER, 1);
+        rules_fire(RULE_EV_POWER, 0);
     }
 
-    if (!state->pwr) {
-        pressed_count++;
-    } else {
-        pressed_count = 0;
+    /* Long press is measured in time, the poll rate varies */
+    if (state->pwr) {
+        pressed_since = 0;
+    } else if (!pressed_since) {
+        pressed_since = now;
+    } else if (now - pressed_since >= LONG_PRESS_MS) {
+        events_set(EVENT_POWEROFF, EVENT_POWEROFF_BUTTON);
+        rules_fire(RULE_EV_POWEROFF, EVENT_POWEROFF_BUTTON);
+        pressed_since = 0;
     }
+}
 
-    if (pressed_count >= 10) { /* 10 polls * 100ms = 1 second */
-        blob_buf_init(&b, 0);
-        blobmsg_add_string(&b, "action", "poweroff");
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
-        }
-        pressed_count = 0;
+/*
+ * PMIC asks for a shutdown and cuts power after the deadline anyway, the
+ * ordered poweroff ends with the shutdown method acknowledging it. Firmware
+ * without the handshake only reports bat_low.
+ */
+static void shutdown_req_send(uint8_t deadline)
+{
+    printf("PMIC requests shutdown, %u s left\n", deadline);
+    events_set(EVENT_POWEROFF, EVENT_POWEROFF_BATTERY);
+    events_set(EVENT_BATTERY_LOW, mirror_regs()->in_state.bat_low);
+    events_set(EVENT_DEADLINE, deadline);
+    rules_fire(RULE_EV_POWEROFF, EVENT_POWEROFF_BATTERY);
+}
+
+static void shutdown_req_done(struct i2cq_job *job)
+{
+    uint8_t deadline = 0;
+
+    if (job->rc == 0) {
+        mirror_store(PMIC_REG_SD_DEADLINE, &job->buf[PMIC_REG_SD_DEADLINE], 1);
+        deadline = mirror_regs()->sd_deadline;
     }
+    shutdown_req_send(deadline);
+    event_flush();
 }
 
-static void low_bat_hnd(void)
+static void shutdown_req_hnd(pmic_in_state_t *state)
 {
-    if (current_state.bat_low) {
-        static struct blob_buf b;
-        blob_buf_init(&b, 0);
-        blobmsg_add_u32(&b, "battery-low", current_state.bat_low);
-        blobmsg_add_string(&b, "action", "poweroff");
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
+    int req = state->sd_req || state->bat_low;
+    int was = current_state.sd_req || current_state.bat_low;
+
+    if (req && !was) {
+        struct i2cq_job *job = NULL;
+        if (g_caps & PMIC_CAP_SD_HANDSHAKE) {
+            job = i2cq_job_new(I2CQ_PRIO_URGENT, shutdown_req_done, NULL);
+        }
+
+        if (!job) {
+            shutdown_req_send(0);
+            return;
+        }
+        i2cq_job_add(job, PMIC_REG_SD_DEADLINE, NULL, 1);
+        if (i2cq_submit(job) < 0) {
+            free(job);
+            shutdown_req_send(0);
         }
+    } else if (!req && was) {
+        /* Battery recovered or a charger came in before the deadline */
+        printf("PMIC withdrew the shutdown request\n");
+        events_set(EVENT_BATTERY_LOW, 0);
+        events_set(EVENT_DEADLINE, 0);
+    }
+}
+
+/* Time from PMIC power-on to the first LTE link, in PMIC ms */
+static int lte_up_reported = 0;
+
+static void lte_up_done(struct i2cq_job *job)
+{
+    if (job->rc < 0) {
+        /* Try again on the next state poll */
+        lte_up_reported = 0;
+        return;
     }
+    mirror_store(PMIC_REG_TM, &job->buf[PMIC_REG_TM], sizeof(uint32_t));
+
+    uint32_t tm = mirror_regs()->tm;
+    printf("LTE up %u ms after power-on\n", tm);
+
+    events_set(EVENT_LTE_UP, tm);
+    event_flush();
+    rules_fire(RULE_EV_LTE, 1);
 }
 
-#if 0
-static void lte_hnd(pmic_state_t *state)
+static void lte_up_hnd(pmic_in_state_t *state)
 {
-    if (state->lte != current_state.lte) {
-        static struct blob_buf b;
-        blob_buf_init(&b, 0);
-        blobmsg_add_u32(&b, "lte", state->lte);
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
+    if (state->lte && !lte_up_reported) {
+        struct i2cq_job *job = i2cq_job_new(I2CQ_PRIO_POLL, lte_up_done, NULL);
+        if (!job) {
+            return;
+        }
+        i2cq_job_add(job, PMIC_REG_TM, NULL, sizeof(uint32_t));
+        if (i2cq_submit(job) < 0) {
+            free(job);
+            return;
         }
+        lte_up_reported = 1;
     }
 }
-#endif
 
-static void charge_hnd(pmic_state_t *state)
+static void charge_hnd(pmic_in_state_t *state)
 {
     if (state->charge != current_state.charge) {
-        static struct blob_buf b;
-        blob_buf_init(&b, 0);
-        blobmsg_add_u32(&b, "charge", !state->charge);
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
-        }
+        events_input(EVENT_CHARGE, !state->charge);
     }
 }
 
-static void standby_hnd(pmic_state_t *state)
+static void standby_hnd(pmic_in_state_t *state)
 {
     if (state->stdby != current_state.stdby) {
-        static struct blob_buf b;
-        blob_buf_init(&b, 0);
-        blobmsg_add_u32(&b, "standby", state->stdby);
-        if (pmicctrl_send_event("pmic", &b) != 0) {
-            fprintf(stderr, "pmicctrl_send_event failed\n");
-        }
+        events_input(EVENT_STANDBY, state->stdby);
     }
 }
 
-static void vbat_poll_cb(struct uloop_timeout *t)
+/*
+ * Poll fast while somebody handles the router or the charger changes, a
+ * little faster than idle close to the low battery threshold and slowly
+ * otherwise.
+ */
+static void poll_adapt(pmic_in_state_t *state)
 {
-    static struct blob_buf b;
-    uint8_t regs[2];
-    int rc = i2c_readn_reg(g_dev, 12, regs, 2);
-    if (rc <= 0) {
-        fprintf(stderr, "Failed to read PMIC registers\n");
-        return;
-    }
+    const struct pmic_config *cfg = config_get();
+    const struct pmic_regs *regs = mirror_regs();
+    uint64_t now = mirror_now();
+    uint32_t status_interval = cfg->status_idle;
+    uint32_t vbat_interval = cfg->battery_interval;
 
-    uint16_t adc_val = (regs[1] << 8) | regs[0];
-    float vbat = DIV_RATIO * (VREF * ((float)adc_val / ADC_MAX));
+    int low = state->bat_low || state->sd_req ||
+              (mirror_age(PMIC_REG_ADC) != MIRROR_AGE_NEVER && regs->adc < VBAT_NEAR_LOW_ADC);
+    if (!state->pwr || state->pwr_evt ||
+        state->charge != current_state.charge || state->stdby != current_state.stdby) {
+        last_activity = now;
+    }
 
-    blob_buf_init(&b, 0);
-    blobmsg_add_float(&b, "battery", vbat);
-    if (pmicctrl_send_event("pmic", &b) != 0) {
-        fprintf(stderr, "pmicctrl_send_event failed\n");
+    if (now - last_activity < ACTIVITY_HOLD) {
+        status_interval = cfg->status_fast;
+    } else if (low) {
+        status_interval = cfg->status_low;
+    }
+    if (low) {
+        vbat_interval = cfg->battery_fast;
     }
 
-    low_bat_hnd();
-    current_state.charge = 0; // to proceed change color on power-on
-    uloop_timeout_set(t, VBAT_POLL_INTERVAL);
+    poll_set_interval(&poll_plan[POLL_STATE], status_interval);
+    poll_set_interval(&poll_plan[POLL_BATTERY], vbat_interval);
 }
 
-static void status_poll_cb(struct uloop_timeout *t)
+static void state_hnd(void)
 {
-    (void)t;
-    pmic_state_t state;
+    static uint32_t seen = 0;
+    pmic_in_state_t state = mirror_regs()->in_state;
     assert(g_dev);
 
-    state.raw = i2c_read_reg(g_dev, 14);
+    /* Every read clears the button latch, but each read counts only once */
+    if (mirror_updates(PMIC_REG_IN_STATE) == seen) {
+        return;
+    }
+    seen = mirror_updates(PMIC_REG_IN_STATE);
 
     power_btn_hnd(&state);
-    //lte_hnd(&state);
+    lte_up_hnd(&state);
     charge_hnd(&state);
     standby_hnd(&state);
+    shutdown_req_hnd(&state);
+    poll_adapt(&state);
 
     current_state.raw = state.raw;
+}
+
+/* Telemetry samples read in_state as well, the state handlers must see them */
+static void telemetry_hnd(void)
+{
+    state_hnd();
+    telemetry_sample();
+}
+
+static void battery_hnd(void)
+{
+    static uint32_t fired = 0;
+    static uint32_t sample = UINT32_MAX;
+    const struct pmic_regs *regs = mirror_regs();
+    uint16_t mv = events_mv(regs->adc);
+    int charging = !regs->in_state.charge;
+    struct forecast f;
+
+    /* The fast poll outruns the PMIC sampling, feed each sample in once */
+    if (regs->tm / PMIC_ADC_INTERVAL == sample) {
+        return;
+    }
+    sample = regs->tm / PMIC_ADC_INTERVAL;
+
+    history_add(mv, events_soc(mv), charging);
+    forecast_add(mirror_now(), events_soc(mv), charging);
+
+    forecast_get(&f);
+    events_input(EVENT_TIME_TO_EMPTY, f.time_to_empty);
+    events_input(EVENT_TIME_TO_FULL, f.time_to_full);
+    events_input(EVENT_CONFIDENCE, f.confidence);
+
+    /* Low battery policy on the minutes left, once per minute of the countdown */
+    if (f.time_to_empty && f.confidence >= FORECAST_CONFIDENT && f.time_to_empty != fired) {
+        fired = f.time_to_empty;
+        rules_fire(RULE_EV_RUNTIME, f.time_to_empty);
+    }
+}
+
+static void history_hnd(void)
+{
+    if (history_checkpoint() < 0) {
+        fprintf(stderr, "Failed to write %s\n", HISTORY_CHECKPOINT_PATH);
+    }
+}
+
+static void metrics_hnd(void)
+{
+    if (metrics_write() < 0) {
+        fprintf(stderr, "Failed to write %s\n", METRICS_PROM_PATH);
+    }
+}
+
+static void heartbeat_hnd(void)
+{
+    static uint8_t hb = 0;
+
+    ++hb;
+    queue_write(I2CQ_PRIO_URGENT, PMIC_REG_HB, &hb, 1, NULL, NULL);
+}
+
+/* End of every poll wakeup, readers of the status page first */
+static void poll_cycle(void)
+{
+    shm_publish();
+    event_flush();
+}
+
+/*
+ * Registers that are only mirrored have no handler. Slow groups coincide
+ * with a state poll, so on those wakeups registers 2..14 are read as one
+ * burst and 29..30 are appended to the same transaction.
+ */
+static struct poll_group poll_plan[__POLL_MAX] = {
+    [POLL_STATE] = {"state", PMIC_REG_IN_STATE, 1, STATUS_POLL_FAST, POLL_PRIO_URGENT, state_hnd, 0},
+    /* Battery events come from event_flush(), past the hysteresis; tm dates the ADC sample */
+    [POLL_BATTERY] = {"battery", PMIC_REG_TM, 10, VBAT_POLL_INTERVAL, 1, battery_hnd, 0},
+    [POLL_CLOCK] = {"clock", PMIC_REG_TM, 4, TELEMETRY_POLL_INTERVAL, 3, NULL, 0},
+    [POLL_LED] = {"led", PMIC_REG_LED_G, 3, TELEMETRY_POLL_INTERVAL, 3, NULL, 0},
+    [POLL_CONFIG] = {"config", PMIC_REG_SD_DEADLINE, 2, TELEMETRY_POLL_INTERVAL, 3, NULL, 0},
+    [POLL_WATCHDOG] = {"watchdog", PMIC_REG_HB_LIMIT, 2, TELEMETRY_POLL_INTERVAL, 3, NULL, 0},
+    /* Enabled once the firmware reports PMIC_CAP_HEARTBEAT */
+    [POLL_HEARTBEAT] = {"heartbeat", 0, 0, 0, 2, heartbeat_hnd, 0},
+    /* Runs at the rate of the fastest telemetry client, off without clients */
+    [POLL_TELEMETRY] = {"telemetry", PMIC_REG_ADC, 3, 0, 1, telemetry_hnd, 0},
+    [POLL_METRICS] = {"metrics", 0, 0, METRICS_INTERVAL, 4, metrics_hnd, 0},
+    [POLL_HISTORY] = {"history", 0, 0, HISTORY_CHECKPOINT_INTERVAL, 4, history_hnd, 0},
+};
+
+/*
+ * Detect the PMIC firmware features, report why the PMIC (or the host
+ * through it) was reset and arm the heartbeat watchdog.
+ */
+static int pmic_probe(void)
+{
+    static const uint8_t zero = 0;
+    const uint8_t hb_limit = config_get()->heartbeat_limit;
+
+    if (mirror_refresh(g_dev, 0, PMIC_REG_COUNT) < 0) {
+        fprintf(stderr, "Failed to read PMIC registers\n");
+        return -1;
+    }
+    const struct pmic_regs regs = *mirror_regs();
+
+    g_caps = regs.version > 0 ? regs.caps : 0;
+    printf("PMIC protocol %u, capabilities 0x%02x\n", regs.version, g_caps);
+    if (!(g_caps & PMIC_CAP_HEARTBEAT)) {
+        return 0;
+    }
 
-    /* Reschedule the poll callback */
-    uloop_timeout_set(t, STATUS_POLL_INTERVAL);
+    printf("PMIC reset cause: 0x%02x, power-on source %u, daemon up %u ms after power-on\n",
+           regs.rst_cause, regs.pwr_on_src, regs.tm);
+    /* Sent once the topic objects are registered, see run_daemon() */
+    events_set(EVENT_RESET_CAUSE, regs.rst_cause);
+    events_set(EVENT_POWER_ON_SOURCE, regs.pwr_on_src);
+    events_set(EVENT_BOOT_MS, regs.tm);
+
+    /* The next daemon start sees only new causes; status keeps reporting this one, no poll reads reg 15 */
+    if (i2c_write_reg(g_dev, PMIC_REG_RST_CAUSE, zero) < 0) {
+        perror("Failed to clear the PMIC reset cause");
+    }
+    if (i2c_write_reg(g_dev, PMIC_REG_HB_LIMIT, hb_limit) == 0) {
+        mirror_store(PMIC_REG_HB_LIMIT, &hb_limit, 1);
+    }
+    return 0;
+}
+
+/*
+ * New settings without a restart: the I2C fd, the ubus objects and their
+ * subscribers stay, only the bus, the address and the capture need one.
+ */
+static void daemon_reload(void)
+{
+    struct pmic_config old = *config_get();
+    const struct pmic_config *cfg = config_get();
+
+    config_load();
+    if (strcmp(old.bus, cfg->bus) != 0 || old.addr != cfg->addr || strcmp(old.trace, cfg->trace) != 0) {
+        fprintf(stderr, "config: bus, addr and trace apply on the next start\n");
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(register_groups); i++) {
+        poll_set_interval(&poll_plan[register_groups[i]], cfg->register_interval);
+    }
+    poll_adapt(&current_state);
+
+    if (g_caps & PMIC_CAP_HEARTBEAT) {
+        queue_write(I2CQ_PRIO_POLL, PMIC_REG_HB_LIMIT, &cfg->heartbeat_limit, 1, NULL, NULL);
+    }
+
+    rules_load();
+    printf("Configuration reloaded\n");
 }
 
 /* --- Main Daemon Function --- */
 int run_daemon(struct I2cDevice *dev)
 {
+    const struct pmic_config *cfg = config_get();
     int ret;
-    static struct uloop_timeout status_poll_timer = {
-        .cb = status_poll_cb,
-    };
-
-    static struct uloop_timeout vbat_poll_timer = {
-        .cb = vbat_poll_cb,
-    };
 
     current_state.raw = 0;
     g_dev = dev;
 
+    /* Loaded by main() along with the bus and the address */
+    poll_plan[POLL_STATE].interval = cfg->status_fast;
+    poll_plan[POLL_BATTERY].interval = cfg->battery_interval;
+    for (size_t i = 0; i < ARRAY_SIZE(register_groups); i++) {
+        poll_plan[register_groups[i]].interval = cfg->register_interval;
+    }
+
     /* Initialize the UBUS handler */
     if ((ret = pmicctrl_handler_init()) != 0) {
         return ret;
     }
 
-    /* Register the pmic object (which supports set_led) */
-    ret = pmicctrl_handler_register_object(&pmic_object);
-    if (ret) {
-        return ret;
+    /* Initialize uloop and run the poll plan on a single timer */
+    uloop_init();
+
+    if (pmic_probe() == 0 && (g_caps & PMIC_CAP_HEARTBEAT)) {
+        poll_plan[POLL_HEARTBEAT].interval = HEARTBEAT_INTERVAL;
     }
 
-    /* Initialize uloop and set up a polling timer */
-    uloop_init();
+    /* Without the status page only its readers lose, keep running */
+    if (shm_start() == 0) {
+        shm_publish();
+    }
+    history_start(pmic_simulated());
+
+    /* From here on all bus traffic goes through the I2C worker */
+    if (i2cq_start(g_dev) < 0) {
+        history_stop();
+        shm_stop();
+        pmicctrl_handler_cleanup();
+        return -1;
+    }
+    poll_on_cycle(poll_cycle);
+    poll_start(poll_plan, ARRAY_SIZE(poll_plan));
+
+    /* Like the status page, optional */
+    telemetry_start(&poll_plan[POLL_TELEMETRY]);
 
-    uloop_timeout_set(&status_poll_timer, STATUS_POLL_INTERVAL);
-    uloop_timeout_set(&vbat_poll_timer, VBAT_POLL_INTERVAL);
+    /* Initial LED state, before anybody can talk to us */
+    rules_load();
+    rules_fire(RULE_EV_START, 0);
 
-    printf("Daemon started. Polling PMIC power button every 100ms and listening for ubus messages...\n");
+    /*
+     * The pmic object goes up last and is the readiness signal: once
+     * `ubus wait_for pmic` returns the mirror is filled and polled.
+     */
+    if ((ret = pmicctrl_handler_register_object(&pmic_object)) != 0 ||
+        (ret = events_init(&pmic_object)) != 0) {
+        fprintf(stderr, "Failed to register the pmic ubus objects\n");
+        rules_free();
+        telemetry_stop();
+        i2cq_stop();
+        history_stop();
+        shm_stop();
+        events_cleanup();
+        pmicctrl_handler_cleanup();
+        return ret;
+    }
+    /* Startup events of pmic_probe() */
+    event_flush();
+
+    printf("Daemon started. Polling PMIC power button every %u-%u ms and listening for ubus messages...\n",
+           cfg->status_fast, cfg->status_idle);
     pmicctrl_handler_loop();
+    rules_free();
+    telemetry_stop();
+    i2cq_stop();
 
+    /* Stopped on purpose, do not let the PMIC power-cycle us */
+    if (g_caps & PMIC_CAP_HEARTBEAT) {
+        i2c_write_reg(g_dev, PMIC_REG_HB_LIMIT, 0);
+    }
+    history_stop();
+    shm_stop();
+    events_cleanup();
     pmicctrl_handler_cleanup();
     return 0;
 }
@@ -2,16 +2,37 @@
 #define __DAEMON_H
 
 #include "i2c.h"
+#include "pmic_regs.h"
 
+/* Defaults of the `config daemon` section of /etc/config/pmic, see config.c */
+#define I2C_BUS "/dev/i2c-0"
 #define VREF 3.3f
 #define ADC_MAX 1024.0f
 #define DIV_RATIO 2.0f
 
-#define STATUS_POLL_INTERVAL 100 // ms
+#define STATUS_POLL_FAST 100 // ms, button held or recent activity
+#define STATUS_POLL_LOW 250 // ms, battery close to the shutdown threshold
+#define STATUS_POLL_IDLE 1000 // ms, nothing happening
+#define ACTIVITY_HOLD 5000 // ms of fast polling after the last activity
+#define LONG_PRESS_MS 1000 // button hold that powers the router off
 #define VBAT_POLL_INTERVAL 5000 // ms
+#define VBAT_POLL_FAST 1000 // ms, below VBAT_NEAR_LOW_ADC
+#define VBAT_NEAR_LOW_ADC 590 // ~3.8v, PMIC asks for shutdown at 560 (~3.6v)
+#define TELEMETRY_POLL_INTERVAL 5000 // ms, registers only kept in the mirror
+#define HEARTBEAT_INTERVAL 1000 // ms
+#define HEARTBEAT_MISSED_LIMIT 60 // PMIC checks once a second, then power-cycles the host
 
 #define dbg() printf("%s:%d\r\n", __FILE__, __LINE__)
 
 int run_daemon(struct I2cDevice *dev);
 
+/*
+ * The bus is the emulator or a replay. Rule actions that reach the real
+ * host are only logged and the battery history stays off flash.
+ */
+int pmic_simulated(void);
+
+/* Queue an LED color write, coalesced with pending ones */
+void pmic_led_set(uint8_t r, uint8_t g, uint8_t b);
+
 #endif
\ No newline at end of file
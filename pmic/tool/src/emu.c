@@ -0,0 +1,417 @@
+/*
+ * emu.c - In-process PMIC behind the I2C transport interface
+ *
+ * Answers register transfers the way pmic/fw/main.c does, against a
+ * scripted battery, so the daemon, its rules and the ubus API run without
+ * the board. The firmware loop is not stepped every ms: each transfer
+ * first catches the model up to mirror_now(), one second at a time.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "emu.h"
+#include "mirror.h"
+#include "pmic_regs.h"
+
+#define EMU_CAPS (PMIC_CAP_HEARTBEAT | PMIC_CAP_PWR_POLICY | PMIC_CAP_SD_HANDSHAKE | PMIC_CAP_BTN_LATCH)
+
+/* What the firmware's I2C slave sends past the register map */
+#define EMU_READ_PAST_END 0xca
+
+struct emu_point
+{
+    uint32_t t;      /* s since power-on */
+    uint16_t mv;     /* Battery voltage */
+    uint8_t charger; /* 0 - none, 1 - charging, 2 - charged */
+    uint32_t button; /* ms the button is held from t */
+};
+
+static const struct emu_point default_curve[] = {
+    {0, 4150, 0, 0},
+    {20 * 3600, 3650, 0, 0},
+    {24 * 3600, 3450, 0, 0},
+};
+
+static struct emu_point g_curve[EMU_CURVE_MAX];
+static size_t g_points;
+
+static struct pmic_regs g_regs;
+static uint64_t g_start;     /* mirror_now() at power-on */
+static uint64_t g_tm;        /* ms the model has run, regs.tm wraps */
+static uint8_t g_hb_last;
+static uint8_t g_hb_missed;
+static uint8_t g_low_samples;
+static int g_in_state_read;  /* in_state went out, the next step re-arms the latch */
+static uint32_t g_seed = 1;
+static int g_running;        /* Powered on, a bus recovery reopen keeps the state */
+static int g_off;            /* Host power cut, every transfer fails */
+
+static int emu_load_curve(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[128];
+    unsigned int lineno = 0;
+    size_t n = 0;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int t, mv, charger = 0, button = 0;
+        char *comment = strchr(line, '#');
+        int fields;
+
+        lineno++;
+        if (comment) {
+            *comment = '\0';
+        }
+
+        fields = sscanf(line, "%u %u %u %u", &t, &mv, &charger, &button);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields < 2 || mv > UINT16_MAX || charger > 2 || n == EMU_CURVE_MAX ||
+            (n && t < g_curve[n - 1].t)) {
+            fprintf(stderr, "emu: %s:%u: bad curve point\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+
+        g_curve[n].t = t;
+        g_curve[n].mv = mv;
+        g_curve[n].charger = charger;
+        g_curve[n].button = button;
+        n++;
+    }
+    fclose(f);
+
+    if (!n) {
+        fprintf(stderr, "emu: %s: no curve points\n", path);
+        return -1;
+    }
+    g_points = n;
+    return 0;
+}
+
+/* Last curve point at or before @ms, the first one before it starts */
+static size_t emu_point_at(uint64_t ms)
+{
+    size_t i = 0;
+
+    while (i + 1 < g_points && (uint64_t)g_curve[i + 1].t * 1000 <= ms) {
+        i++;
+    }
+    return i;
+}
+
+static uint16_t emu_mv(uint64_t ms)
+{
+    size_t i = emu_point_at(ms);
+    const struct emu_point *a = &g_curve[i];
+    const struct emu_point *b;
+    uint64_t from = (uint64_t)a->t * 1000;
+
+    if (i + 1 >= g_points || ms < from) {
+        return a->mv;
+    }
+    b = &g_curve[i + 1];
+    /* Points at the same second step the voltage, the later one wins */
+    if (b->t == a->t) {
+        return b->mv;
+    }
+    return a->mv + ((int64_t)b->mv - a->mv) * (int64_t)(ms - from) / ((int64_t)(b->t - a->t) * 1000);
+}
+
+/* Button held at any time within [from, to] */
+static int emu_button(uint64_t from, uint64_t to)
+{
+    for (size_t i = 0; i < g_points; i++) {
+        uint64_t down = (uint64_t)g_curve[i].t * 1000;
+        if (g_curve[i].button && down <= to && down + g_curve[i].button > from) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t emu_rand(void)
+{
+    g_seed = g_seed * 1103515245 + 12345;
+    return g_seed >> 16;
+}
+
+static void emu_power_cut(const char *why)
+{
+    fprintf(stderr, "emu: host power cut, %s\n", why);
+    g_off = 1;
+    kill(getpid(), SIGTERM);
+}
+
+static int emu_charger(uint64_t ms)
+{
+    return g_curve[emu_point_at(ms)].charger != 0;
+}
+
+static void emu_bat_low_cancel(void)
+{
+    g_regs.in_state.bat_low = 0;
+    g_regs.in_state.sd_req = 0;
+    g_regs.sd_deadline = 0;
+}
+
+/* ADC branch of the firmware loop, one LSB of noise either way */
+static void emu_sample(uint64_t ms)
+{
+    int32_t adc = (int32_t)((uint32_t)emu_mv(ms) * 1024 / config_get()->adc_full_mv) + (int32_t)(emu_rand() % 3) - 1;
+
+    g_regs.adc = adc < 0 ? 0 : adc > 1023 ? 1023 : adc;
+
+    if (g_regs.adc >= EMU_BAT_LOW_ADC) {
+        g_low_samples = 0;
+        if (g_regs.in_state.sd_req && g_regs.adc >= EMU_BAT_LOW_CLEAR) {
+            emu_bat_low_cancel();
+        }
+    } else if (g_low_samples < EMU_BAT_LOW_SAMPLES) {
+        g_low_samples++;
+    }
+    if (g_low_samples == EMU_BAT_LOW_SAMPLES && !g_regs.in_state.sd_req && !emu_charger(ms)) {
+        g_regs.in_state.bat_low = 1;
+        g_regs.in_state.sd_req = 1;
+        g_regs.sd_deadline = EMU_BAT_LOW_DEADLINE;
+    }
+}
+
+/* Input pins as of @to, with the button latch over (from, to] */
+static void emu_pins(uint64_t from, uint64_t to)
+{
+    uint8_t charger = g_curve[emu_point_at(to)].charger;
+
+    /* TP4056 pulls CHRG low while charging and STDBY low when done */
+    g_regs.in_state.charge = charger != 1;
+    g_regs.in_state.stdby = charger != 2;
+    g_regs.in_state.pwr = !emu_button(to, to);
+
+    if (g_in_state_read) {
+        g_in_state_read = 0;
+        g_regs.in_state.pwr_evt = 0;
+    }
+    if (emu_button(from, to)) {
+        g_regs.in_state.pwr_evt = 1;
+    }
+}
+
+/* Run the firmware loop up to mirror_now() */
+static void emu_advance(void)
+{
+    uint64_t now = mirror_now() - g_start;
+    uint64_t from = g_tm;
+
+    if (now <= g_tm) {
+        return;
+    }
+
+    /* Applied on the loop right after the write */
+    g_regs.led_upd = 0;
+
+    /* Shutdown deadline and heartbeat are checked on whole seconds, the ADC every EMU_ADC_INT */
+    for (uint64_t s = (g_tm / 1000 + 1) * 1000; s <= now; s += 1000) {
+        if (s % EMU_ADC_INT == 0) {
+            emu_sample(s);
+        }
+
+        if (g_regs.in_state.sd_req) {
+            if (emu_charger(s)) {
+                emu_bat_low_cancel();
+            } else if (g_regs.sd_deadline == 0) {
+                emu_power_cut("shutdown not acknowledged");
+                return;
+            } else {
+                g_regs.sd_deadline--;
+            }
+        }
+
+        if (g_regs.hb_limit > 0) {
+            if (g_regs.hb != g_hb_last) {
+                g_hb_last = g_regs.hb;
+                g_hb_missed = 0;
+            } else if (++g_hb_missed >= g_regs.hb_limit) {
+                emu_power_cut("heartbeat lost");
+                return;
+            }
+        }
+    }
+
+    g_tm = now;
+    g_regs.tm = (uint32_t)now;
+    emu_pins(from, now);
+}
+
+static void emu_power_on(void)
+{
+    memset(&g_regs, 0, sizeof(g_regs));
+    for (size_t i = 0; i < sizeof(g_regs.uid); i++) {
+        g_regs.uid[i] = emu_rand();
+    }
+    g_regs.led_r = 0x30;
+    g_regs.led_g = 0x20;
+    g_regs.led_b = 0x10;
+    g_regs.led_upd = 1;
+    g_regs.rst_cause = PMIC_RST_CAUSE_POR;
+    g_regs.pwr_policy = PMIC_PWR_POLICY_BUTTON;
+    g_regs.pwr_on_src = PMIC_PWR_ON_SRC_BUTTON;
+    g_regs.version = PMIC_PROTO_VERSION;
+    g_regs.caps = EMU_CAPS;
+
+    g_start = mirror_now();
+    g_tm = 0;
+
+    /* The host takes longer to boot than the firmware to its first ADC sample */
+    emu_sample(0);
+    emu_pins(0, 0);
+}
+
+static int emu_start(struct I2cDevice *dev, const char *bus)
+{
+    char opts[256];
+    char *save = NULL;
+    char *opt;
+    const char *curve = NULL;
+    unsigned long speed = 1;
+    unsigned long seed = 1;
+
+    if (snprintf(opts, sizeof(opts), "%s", bus) >= (int)sizeof(opts)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(opt, '=');
+        char *end;
+
+        if (!val) {
+            goto bad_opt;
+        }
+        *val++ = '\0';
+
+        if (strcmp(opt, "speed") == 0) {
+            speed = strtoul(val, &end, 10);
+            if (*end || !speed || speed > 100000) {
+                goto bad_opt;
+            }
+        } else if (strcmp(opt, "seed") == 0) {
+            seed = strtoul(val, &end, 10);
+            if (*end) {
+                goto bad_opt;
+            }
+        } else if (strcmp(opt, "curve") == 0) {
+            curve = val;
+        } else {
+            goto bad_opt;
+        }
+    }
+
+    dev->fd = -1;
+    if (g_running) {
+        return 0;
+    }
+
+    if (curve) {
+        if (emu_load_curve(curve) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        memcpy(g_curve, default_curve, sizeof(default_curve));
+        g_points = sizeof(default_curve) / sizeof(default_curve[0]);
+    }
+
+    mirror_set_speed(speed);
+    g_seed = seed;
+    emu_power_on();
+    g_running = 1;
+    fprintf(stderr, "emu: PMIC emulator, %zu curve points, speed %lu\n", g_points, speed);
+    return 0;
+
+bad_opt:
+    fprintf(stderr, "emu: bad option '%s', expected speed=N, curve=FILE or seed=N\n", opt);
+    errno = EINVAL;
+    return -1;
+}
+
+static void emu_read(uint8_t reg, uint8_t *buf, size_t len)
+{
+    const uint8_t *raw = (const uint8_t *)&g_regs;
+
+    for (size_t i = 0; i < len; i++) {
+        size_t pos = reg + i;
+
+        buf[i] = pos < PMIC_REG_COUNT ? raw[pos] : EMU_READ_PAST_END;
+        if (pos == PMIC_REG_IN_STATE) {
+            g_in_state_read = 1;
+        }
+    }
+}
+
+static void emu_write(uint8_t reg, const uint8_t *buf, size_t len)
+{
+    uint8_t *raw = (uint8_t *)&g_regs;
+
+    /* Bytes past the register map are dropped */
+    for (size_t i = 0; i < len && reg + i < PMIC_REG_COUNT; i++) {
+        raw[reg + i] = buf[i];
+    }
+
+    /* onWrite(): identification is read-only, no bootloader in this build */
+    g_regs.version = PMIC_PROTO_VERSION;
+    g_regs.caps = EMU_CAPS;
+    if (g_regs.off == PMIC_OFF_SHUTDOWN) {
+        emu_power_cut("shutdown acknowledged");
+    }
+}
+
+static int emu_xfer(struct I2cDevice *dev, struct i2c_xfer *xfers, size_t count)
+{
+    (void)dev;
+
+    if (g_off) {
+        return -ENXIO;
+    }
+    emu_advance();
+
+    for (size_t i = 0; i < count; i++) {
+        if (g_off) {
+            return -ENXIO;
+        }
+        if (xfers[i].len == 0 || xfers[i].len > I2C_XFER_MAX) {
+            return -EINVAL;
+        }
+
+        if (xfers[i].write) {
+            emu_write(xfers[i].reg, xfers[i].buf, xfers[i].len);
+        } else {
+            emu_read(xfers[i].reg, xfers[i].buf, xfers[i].len);
+        }
+    }
+    return 0;
+}
+
+static void emu_stop(struct I2cDevice *dev)
+{
+    (void)dev;
+}
+
+const struct i2c_ops emu_ops = {
+    .prefix = "emu:",
+    .simulated = 1,
+    .start = emu_start,
+    .xfer = emu_xfer,
+    .stop = emu_stop,
+};
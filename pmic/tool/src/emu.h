@@ -0,0 +1,32 @@
+#ifndef __EMU_H
+#define __EMU_H
+
+#include "i2c.h"
+
+/* Battery curve points read from a curve= file */
+#define EMU_CURVE_MAX 256
+
+/* Firmware constants the emulator mirrors, see pmic/fw/main.c */
+#define EMU_ADC_INT 5000        /* ms between battery ADC samples */
+#define EMU_BAT_LOW_ADC 560     /* ADC below which a shutdown is requested */
+#define EMU_BAT_LOW_SAMPLES 3   /* Consecutive low samples before the request */
+#define EMU_BAT_LOW_CLEAR 575   /* ADC above which the request is withdrawn */
+#define EMU_BAT_LOW_DEADLINE 50 /* s from the request until power is cut */
+
+/*
+ * In-process PMIC, selected with a bus name of
+ *
+ *   emu:[speed=N][,curve=FILE][,seed=N]
+ *
+ * speed runs the daemon clock N times faster. A curve file holds lines of
+ * `<s> <mV> [charger] [button ms]`, charger being 0 - none, 1 - charging,
+ * 2 - charged; the voltage is interpolated between the lines and the last
+ * line holds from then on. Without one the battery drains from 4.15 V to
+ * 3.45 V over a day. seed varies the ADC noise and the unique ID.
+ *
+ * Cutting the host power, on a shutdown ack, an expired shutdown deadline
+ * or missed heartbeats, sends SIGTERM to the process.
+ */
+extern const struct i2c_ops emu_ops;
+
+#endif
@@ -0,0 +1,354 @@
+/*
+ * events.c - Coalesced PMIC notifications
+ *
+ * Handlers of one poll cycle only record what changed, the cycle ends with
+ * one notification per topic that carries native numbers and a sequence
+ * number, so subscribers can tell when they missed one. Charger pins flap
+ * while the TP4056 runs without a cell, they are rate limited; the battery
+ * voltage only triggers a notification of its own past a hysteresis.
+ *
+ * Notifications go to `ubus subscribe` clients of the topic objects, not
+ * to the ubusd event bus, so nothing is built or sent while nobody listens.
+ */
+
+#include <libubox/blobmsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "daemon.h"
+#include "events.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "ubus.h"
+
+static const struct
+{
+    const char *name;
+    uint8_t topic;
+    uint32_t interval; /* Rate limit, ms, 0 - every change */
+} event_fields[__EVENT_MAX] = {
+    [EVENT_POWER] = {"power", EVENT_TOPIC_BUTTON, 0},
+    [EVENT_TAP] = {"tap", EVENT_TOPIC_BUTTON, 0},
+    [EVENT_CHARGE] = {"charge", EVENT_TOPIC_CHARGER, EVENTS_INPUT_INTERVAL},
+    [EVENT_STANDBY] = {"standby", EVENT_TOPIC_CHARGER, EVENTS_INPUT_INTERVAL},
+    [EVENT_LTE_UP] = {"lte-up-ms", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_POWEROFF] = {"poweroff", EVENT_TOPIC_BUTTON, 0},
+    [EVENT_BATTERY_LOW] = {"battery-low", EVENT_TOPIC_BATTERY, 0},
+    [EVENT_DEADLINE] = {"deadline", EVENT_TOPIC_BATTERY, 0},
+    [EVENT_RESET_CAUSE] = {"reset-cause", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_POWER_ON_SOURCE] = {"power-on-source", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_BOOT_MS] = {"boot-ms", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_BUS_FAILED] = {"bus-failed", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_BUS_RECOVERIES] = {"bus-recoveries", EVENT_TOPIC_HEALTH, 0},
+    [EVENT_TIME_TO_EMPTY] = {"time-to-empty", EVENT_TOPIC_BATTERY, EVENTS_FORECAST_INTERVAL},
+    [EVENT_TIME_TO_FULL] = {"time-to-full", EVENT_TOPIC_BATTERY, EVENTS_FORECAST_INTERVAL},
+    [EVENT_CONFIDENCE] = {"confidence", EVENT_TOPIC_BATTERY, EVENTS_FORECAST_INTERVAL},
+};
+
+struct event_topic_obj
+{
+    const char *name;
+    struct ubus_object obj;
+    uint32_t seq;      /* Flushes with changes of the topic */
+    uint64_t last;     /* mirror_now() of the last notification */
+    uint32_t held;     /* EVENT_BIT()s kept back by the interval, go out with the next notification */
+    uint8_t due;       /* A change was kept back, held or battery only */
+    struct
+    {
+        uint32_t peer;
+        uint32_t interval;
+        uint64_t expires; /* mirror_now() the request lapses at */
+    } peers[EVENTS_PEERS_MAX];
+};
+
+/* One-shot edges, a topic interval never holds them back */
+#define EVENT_EDGES                                                                                          \
+    (EVENT_BIT(EVENT_POWER) | EVENT_BIT(EVENT_TAP) | EVENT_BIT(EVENT_POWEROFF) | EVENT_BIT(EVENT_BATTERY_LOW) | \
+     EVENT_BIT(EVENT_DEADLINE))
+
+static struct ubus_object_type topic_type = {
+    .name = "pmic-topic",
+};
+
+static void topic_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj);
+
+static struct event_topic_obj g_topics[__EVENT_TOPIC_MAX] = {
+    [EVENT_TOPIC_BUTTON] = {.name = "button", .obj = {.name = "pmic.button"}},
+    [EVENT_TOPIC_CHARGER] = {.name = "charger", .obj = {.name = "pmic.charger"}},
+    [EVENT_TOPIC_BATTERY] = {.name = "battery", .obj = {.name = "pmic.battery"}},
+    [EVENT_TOPIC_HEALTH] = {.name = "health", .obj = {.name = "pmic.health"}},
+};
+
+/* Subscribers of the main object get every topic */
+static struct ubus_object *g_all = NULL;
+
+static struct
+{
+    uint32_t value;   /* Latest value */
+    uint32_t sent;    /* Value in the last event */
+    uint64_t last;    /* mirror_now() of the last event with the field */
+    uint8_t pending;  /* Goes out with the next event */
+    uint8_t valid;    /* sent/last are set */
+} g_fields[__EVENT_MAX];
+
+static uint32_t g_seq = 0;
+static uint32_t g_registered = 0;
+static uint16_t g_sent_mv = 0;
+static uint64_t g_sent_mv_at = 0;
+
+/* Open-circuit voltage of a Li-ion cell against its state of charge */
+static const struct
+{
+    uint16_t mv;
+    uint8_t soc;
+} soc_curve[] = {
+    {3300, 0},
+    {3500, 5},
+    {3600, 10},
+    {3700, 25},
+    {3750, 40},
+    {3800, 55},
+    {3850, 65},
+    {3900, 72},
+    {4000, 83},
+    {4100, 93},
+    {4200, 100},
+};
+
+static void topic_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj)
+{
+    (void)ctx;
+    struct event_topic_obj *t = container_of(obj, struct event_topic_obj, obj);
+
+    /* Peers are not tracked one by one, forget them with the last subscriber */
+    if (!obj->has_subscribers) {
+        memset(t->peers, 0, sizeof(t->peers));
+        t->held = 0;
+        t->due = 0;
+    }
+}
+
+int events_init(struct ubus_object *all)
+{
+    g_all = all;
+    for (int i = 0; i < __EVENT_TOPIC_MAX; i++) {
+        g_topics[i].obj.type = &topic_type;
+        g_topics[i].obj.subscribe_cb = topic_subscribe_cb;
+        if (pmicctrl_handler_register_object(&g_topics[i].obj) != 0) {
+            return -1;
+        }
+        g_registered |= 1u << i;
+    }
+    return 0;
+}
+
+void events_cleanup(void)
+{
+    for (int i = 0; i < __EVENT_TOPIC_MAX; i++) {
+        if (g_registered & (1u << i)) {
+            ubus_remove_object(pmicctrl_handler_get_context(), &g_topics[i].obj);
+        }
+    }
+    g_registered = 0;
+}
+
+int events_set_interval(const char *topic, uint32_t peer, uint32_t interval)
+{
+    struct event_topic_obj *t = NULL;
+    int slot = -1;
+
+    for (int i = 0; i < __EVENT_TOPIC_MAX; i++) {
+        if (strcmp(topic, g_topics[i].name) == 0) {
+            t = &g_topics[i];
+        }
+    }
+    if (!t) {
+        return UBUS_STATUS_NOT_FOUND;
+    }
+
+    for (int i = 0; i < EVENTS_PEERS_MAX; i++) {
+        if (t->peers[i].peer == peer) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 && !t->peers[i].peer) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return UBUS_STATUS_NO_MEMORY;
+    }
+
+    /* 0 drops the peer, it gets every change again */
+    t->peers[slot].peer = interval ? peer : 0;
+    t->peers[slot].interval = interval;
+    t->peers[slot].expires = mirror_now() + EVENTS_PEER_LEASE;
+    return UBUS_STATUS_OK;
+}
+
+/*
+ * Shortest interval a live peer asked for, 0 - every change; applies to all
+ * subscribers of the topic. A peer that went away stops counting once its
+ * request lapses.
+ */
+static uint32_t topic_interval(struct event_topic_obj *t, uint64_t now)
+{
+    uint32_t min = 0;
+
+    for (int i = 0; i < EVENTS_PEERS_MAX; i++) {
+        if (t->peers[i].peer && now >= t->peers[i].expires) {
+            t->peers[i].peer = 0;
+        }
+        if (t->peers[i].peer && (!min || t->peers[i].interval < min)) {
+            min = t->peers[i].interval;
+        }
+    }
+    return min;
+}
+
+uint16_t events_mv(uint16_t adc)
+{
+    return (uint32_t)adc * config_get()->adc_full_mv / (uint32_t)ADC_MAX;
+}
+
+uint8_t events_soc(uint16_t mv)
+{
+    if (mv <= soc_curve[0].mv) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < ARRAY_SIZE(soc_curve); i++) {
+        if (mv < soc_curve[i].mv) {
+            uint16_t lo = soc_curve[i - 1].mv;
+            uint16_t span = soc_curve[i].mv - lo;
+            uint8_t soc = soc_curve[i - 1].soc;
+            return soc + (mv - lo) * (soc_curve[i].soc - soc) / span;
+        }
+    }
+    return 100;
+}
+
+void events_set(enum event_field field, uint32_t value)
+{
+    g_fields[field].value = value;
+    g_fields[field].pending = 1;
+}
+
+void events_input(enum event_field field, uint32_t value)
+{
+    g_fields[field].value = value;
+
+    /* Flapped back before the change went out */
+    g_fields[field].pending = !g_fields[field].valid || value != g_fields[field].sent;
+}
+
+static int events_ready(int field, uint64_t now)
+{
+    return g_fields[field].pending &&
+           (!g_fields[field].valid || now - g_fields[field].last >= event_fields[field].interval);
+}
+
+static void events_notify(struct ubus_object *obj, const char *type, uint32_t seq,
+                          uint32_t fields, uint16_t mv)
+{
+    static struct blob_buf b;
+    uint64_t start = metrics_us();
+
+    blob_buf_init(&b, 0);
+    blobmsg_add_u32(&b, "seq", seq);
+    blobmsg_add_u32(&b, "mv", mv);
+    blobmsg_add_u32(&b, "soc", events_soc(mv));
+    blobmsg_add_u32(&b, "flags", mirror_regs()->in_state.raw);
+    for (int i = 0; i < __EVENT_MAX; i++) {
+        if (fields & EVENT_BIT(i)) {
+            blobmsg_add_u32(&b, event_fields[i].name, g_fields[i].value);
+        }
+    }
+
+    if (pmicctrl_notify(obj, type, &b) != 0) {
+        fprintf(stderr, "Failed to notify %s subscribers\n", type);
+    }
+    metrics_observe(METRIC_NOTIFY, metrics_us() - start);
+}
+
+uint32_t events_flush(void)
+{
+    const struct pmic_regs *regs = mirror_regs();
+    uint64_t now = mirror_now();
+    uint16_t mv = events_mv(regs->adc);
+    uint32_t fields = 0;
+
+    for (int i = 0; i < __EVENT_MAX; i++) {
+        if (events_ready(i, now)) {
+            fields |= EVENT_BIT(i);
+        }
+    }
+
+    int battery = mirror_age(PMIC_REG_ADC) != MIRROR_AGE_NEVER &&
+                  abs((int)mv - (int)g_sent_mv) >= EVENTS_BATTERY_HYST_MV &&
+                  now - g_sent_mv_at >= EVENTS_BATTERY_INTERVAL;
+    int due = 0;
+    for (int t = 0; t < __EVENT_TOPIC_MAX; t++) {
+        due |= g_topics[t].due;
+    }
+    if (!fields && !battery && !due) {
+        return 0;
+    }
+
+    /* Only held back topic notifications left */
+    if (fields || battery) {
+        g_seq++;
+        if (g_all && g_all->has_subscribers) {
+            events_notify(g_all, "pmic", g_seq, fields, mv);
+        }
+    }
+
+    for (int t = 0; t < __EVENT_TOPIC_MAX; t++) {
+        struct event_topic_obj *topic = &g_topics[t];
+        uint32_t mask = 0;
+
+        for (int i = 0; i < __EVENT_MAX; i++) {
+            if (event_fields[i].topic == t) {
+                mask |= EVENT_BIT(i);
+            }
+        }
+        if ((fields & mask) || (battery && t == EVENT_TOPIC_BATTERY)) {
+            topic->seq++;
+            topic->due = topic->obj.has_subscribers;
+        }
+        if (!topic->due) {
+            continue;
+        }
+
+        /* Changes within the interval are coalesced into the next notification, edges go out at once */
+        topic->held |= fields & mask;
+        if (!(topic->held & EVENT_EDGES) && now - topic->last < topic_interval(topic, now)) {
+            continue;
+        }
+        events_notify(&topic->obj, topic->name, topic->seq, topic->held, mv);
+        topic->held = 0;
+        topic->due = 0;
+        topic->last = now;
+    }
+
+    for (int i = 0; i < __EVENT_MAX; i++) {
+        if (fields & EVENT_BIT(i)) {
+            g_fields[i].sent = g_fields[i].value;
+            g_fields[i].last = now;
+            g_fields[i].pending = 0;
+            g_fields[i].valid = 1;
+        }
+    }
+    if (fields || battery) {
+        g_sent_mv = mv;
+        g_sent_mv_at = now;
+    }
+    return fields;
+}
+
+uint32_t events_get(enum event_field field)
+{
+    return g_fields[field].sent;
+}
@@ -0,0 +1,117 @@
+#ifndef __EVENTS_H
+#define __EVENTS_H
+
+#include <libubus.h>
+#include <stdint.h>
+
+/* Shortest time between two reports of a flapping charger pin, ms */
+#define EVENTS_INPUT_INTERVAL 1000
+
+/* Battery change that is worth an event of its own, mV */
+#define EVENTS_BATTERY_HYST_MV 20
+
+/* Shortest time between two battery-only events, ms */
+#define EVENTS_BATTERY_INTERVAL 10000
+
+/* Shortest time between two reports of a changed battery forecast, ms */
+#define EVENTS_FORECAST_INTERVAL 60000
+
+/* Subscribers per topic that may ask for a minimum interval */
+#define EVENTS_PEERS_MAX 8
+
+/* Lifetime of an interval request, a peer that is still there repeats it, ms */
+#define EVENTS_PEER_LEASE 300000
+
+/*
+ * Notification topics, each one is an object of its own (pmic.button, ...)
+ * so `ubus subscribe` picks the topics. Subscribers of the pmic object get
+ * everything.
+ */
+enum event_topic
+{
+    EVENT_TOPIC_BUTTON,
+    EVENT_TOPIC_CHARGER,
+    EVENT_TOPIC_BATTERY,
+    EVENT_TOPIC_HEALTH,
+    __EVENT_TOPIC_MAX,
+};
+
+/*
+ * Fields of the notifications. Besides the fields of its topic that
+ * changed, every notification carries seq, mv, soc and the raw in_state
+ * flags.
+ */
+enum event_field
+{
+    EVENT_POWER,           /* Power button, 1 - pressed */
+    EVENT_TAP,             /* Press and release latched between two polls */
+    EVENT_CHARGE,          /* 1 - charging, rate limited */
+    EVENT_STANDBY,         /* TP4056 standby pin, rate limited */
+    EVENT_LTE_UP,          /* PMIC ms from power-on to the first LTE link */
+    EVENT_POWEROFF,        /* EVENT_POWEROFF_* */
+    EVENT_BATTERY_LOW,     /* bat_low along with a PMIC shutdown request */
+    EVENT_DEADLINE,        /* s until the PMIC cuts power */
+    EVENT_RESET_CAUSE,     /* PMIC_RST_CAUSE_* at daemon start */
+    EVENT_POWER_ON_SOURCE, /* PMIC_PWR_ON_SRC_* at daemon start */
+    EVENT_BOOT_MS,         /* PMIC ms from power-on to daemon start */
+    EVENT_BUS_FAILED,      /* I2C jobs failed after all retries */
+    EVENT_BUS_RECOVERIES,  /* I2C bus recoveries */
+    EVENT_TIME_TO_EMPTY,   /* Predicted min, 0 - unknown, rate limited */
+    EVENT_TIME_TO_FULL,    /* Predicted min, 0 - unknown, rate limited */
+    EVENT_CONFIDENCE,      /* Of the prediction, percent, rate limited */
+    __EVENT_MAX,
+};
+
+#define EVENT_BIT(field) (1u << (field))
+
+/* Causes reported in EVENT_POWEROFF, the poweroff rule event has the same values */
+#define EVENT_POWEROFF_BUTTON 1  /* Long button press */
+#define EVENT_POWEROFF_BATTERY 2 /* PMIC shutdown request */
+
+/* Register the topic objects, @all is notified of every topic */
+int events_init(struct ubus_object *all);
+
+/* Remove the topic objects */
+void events_cleanup(void);
+
+/*
+ * Minimum interval between two notifications of a topic, asked for by one
+ * peer. ubus notifies all subscribers of an object at once and never tells
+ * which one left, so the limit is topic-wide and leased: the topic goes out
+ * at the shortest interval a peer asked for within EVENTS_PEER_LEASE, 0 -
+ * every change, and all requests go with the last subscriber. Changes in
+ * between are coalesced into the next notification with their latest
+ * values, the seq gap tells; edges like a tap or a shutdown request are
+ * never held back. Returns a UBUS_STATUS_* code.
+ */
+int events_set_interval(const char *topic, uint32_t peer, uint32_t interval);
+
+/* Battery voltage of a raw ADC sample */
+uint16_t events_mv(uint16_t adc);
+
+/* Rough state of charge of a resting Li-ion cell, percent */
+uint8_t events_soc(uint16_t mv);
+
+/* Report the value in the next event, even if it did not change */
+void events_set(enum event_field field, uint32_t value);
+
+/*
+ * Report a level input. Rate limited fields are reported at most once per
+ * interval with their latest value, a level that flaps back before it was
+ * reported is dropped.
+ */
+void events_input(enum event_field field, uint32_t value);
+
+/*
+ * Notify everything collected since the last flush, one notification per
+ * topic with subscribers. The battery topic is also notified when the
+ * battery moved by EVENTS_BATTERY_HYST_MV. Payloads of topics nobody
+ * subscribed to are never built. Returns the EVENT_BIT()s of the fields
+ * that were flushed, subscribed to or not.
+ */
+uint32_t events_flush(void);
+
+/* Value of the field when it was last flushed */
+uint32_t events_get(enum event_field field);
+
+#endif
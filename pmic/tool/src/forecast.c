@@ -0,0 +1,118 @@
+/*
+ * forecast.c - Time to empty and time to full of the battery
+ *
+ * A two-state Kalman filter follows the state of charge and its rate of
+ * change. The rate is modelled as a random walk, so the estimate follows
+ * load changes within minutes while the steps of the ADC and of the SoC
+ * curve average out. Whether the battery runs empty or full follows from
+ * the sign of the rate, not from the charger pin: a weak charger behind a
+ * busy router still discharges.
+ *
+ * The confidence is r^2 / (r^2 + 4 var(r)), 50 % when the rate is two
+ * standard deviations away from zero.
+ */
+
+#include <string.h>
+
+#include "forecast.h"
+
+/* SoC measurement noise, %^2: curve steps and load sag */
+#define FORECAST_R 4.0
+
+/* Rate random walk, (%/h)^2 per hour */
+#define FORECAST_Q 1.0
+
+/* Rate variance after a restart, (%/h)^2 */
+#define FORECAST_RATE_VAR 100.0
+
+/* Slower rates count as idle, %/h */
+#define FORECAST_RATE_MIN 0.1
+
+static struct
+{
+    int valid;      /* Has samples */
+    int charging;
+    uint64_t start; /* mirror_now() of the restart */
+    uint64_t t;     /* mirror_now() of the last sample */
+    double soc;     /* % */
+    double rate;    /* %/h */
+    double p00, p01, p11; /* Covariance */
+} g_kf;
+
+static void forecast_restart(uint64_t now, uint8_t soc, int charging)
+{
+    g_kf.valid = 1;
+    g_kf.start = now;
+    g_kf.t = now;
+    g_kf.charging = charging;
+    g_kf.soc = soc;
+    g_kf.rate = 0;
+    g_kf.p00 = FORECAST_R;
+    g_kf.p01 = 0;
+    g_kf.p11 = FORECAST_RATE_VAR;
+}
+
+void forecast_add(uint64_t now, uint8_t soc, int charging)
+{
+    charging = !!charging;
+    if (!g_kf.valid || charging != g_kf.charging) {
+        forecast_restart(now, soc, charging);
+        return;
+    }
+    if (now <= g_kf.t) {
+        return;
+    }
+
+    /* Surface charge after a charger change reads as a steep slope */
+    if (now - g_kf.start < FORECAST_SETTLE) {
+        g_kf.t = now;
+        g_kf.soc = soc;
+        return;
+    }
+
+    double dt = (now - g_kf.t) / 3600000.0;
+    g_kf.t = now;
+
+    /* Predict, the rate drifts */
+    g_kf.soc += g_kf.rate * dt;
+    g_kf.p00 += dt * (2 * g_kf.p01 + dt * g_kf.p11) + FORECAST_Q * dt * dt * dt / 3;
+    g_kf.p01 += dt * g_kf.p11 + FORECAST_Q * dt * dt / 2;
+    g_kf.p11 += FORECAST_Q * dt;
+
+    /* Update with the measured SoC */
+    double s = g_kf.p00 + FORECAST_R;
+    double k0 = g_kf.p00 / s;
+    double k1 = g_kf.p01 / s;
+    double y = soc - g_kf.soc;
+
+    g_kf.soc += k0 * y;
+    g_kf.rate += k1 * y;
+    g_kf.p11 -= k1 * g_kf.p01;
+    g_kf.p00 -= k0 * g_kf.p00;
+    g_kf.p01 -= k0 * g_kf.p01;
+}
+
+void forecast_get(struct forecast *f)
+{
+    double r = g_kf.rate;
+    double soc = g_kf.soc < 0 ? 0 : g_kf.soc > 100 ? 100 : g_kf.soc;
+    double minutes;
+
+    memset(f, 0, sizeof(*f));
+    if (!g_kf.valid || (r < FORECAST_RATE_MIN && r > -FORECAST_RATE_MIN)) {
+        return;
+    }
+
+    f->rate = (int32_t)(r * 10 + (r < 0 ? -0.5 : 0.5));
+    minutes = (r < 0 ? soc / -r : (100 - soc) / r) * 60;
+    if (minutes > FORECAST_MINUTES_MAX) {
+        return;
+    }
+
+    f->confidence = 100 * r * r / (r * r + 4 * g_kf.p11);
+    if (r < 0) {
+        f->time_to_empty = minutes < 1 ? 1 : (uint32_t)(minutes + 0.5);
+    } else {
+        f->time_to_full = minutes < 1 ? 1 : (uint32_t)(minutes + 0.5);
+    }
+}
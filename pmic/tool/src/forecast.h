@@ -0,0 +1,32 @@
+#ifndef __FORECAST_H
+#define __FORECAST_H
+
+#include <stdint.h>
+
+/* Confidence from which a time to empty drives the runtime rules, percent */
+#define FORECAST_CONFIDENT 50
+
+/* Longer predictions are reported as unknown, min */
+#define FORECAST_MINUTES_MAX (30 * 24 * 60)
+
+/* Samples right after a charger change, while the cell voltage settles, ms */
+#define FORECAST_SETTLE 120000
+
+struct forecast
+{
+    uint32_t time_to_empty; /* min, 0 - not discharging or unknown */
+    uint32_t time_to_full;  /* min, 0 - not charging or unknown */
+    uint8_t confidence;     /* percent */
+    int32_t rate;           /* SoC change, 0.1 %/h */
+};
+
+/*
+ * Add a battery sample, @now in mirror_now() ms. A change of @charging
+ * restarts the estimate, the rate before and after has nothing in common.
+ */
+void forecast_add(uint64_t now, uint8_t soc, int charging);
+
+/* Current estimate, all zero until the filter has a rate */
+void forecast_get(struct forecast *f);
+
+#endif
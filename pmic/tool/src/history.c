@@ -0,0 +1,363 @@
+/*
+ * history.c - Battery time series in a memory-mapped ring file
+ *
+ * RRD style: one fixed-size ring of records per downsampling tier, all in
+ * one file on tmpfs, so a sample costs a few stores into the mapping and
+ * no syscall. The file survives daemon restarts; reboots are covered by a
+ * periodic copy on flash.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "mirror.h"
+
+#define HISTORY_MAGIC 0x48434d50 /* "PMCH" */
+#define HISTORY_VERSION 1
+
+static const struct
+{
+    const char *name;
+    uint32_t resolution; /* s */
+    uint32_t capacity;   /* records */
+} tier_layout[__HISTORY_TIER_MAX] = {
+    [HISTORY_RAW] = {"raw", 5, 720},
+    [HISTORY_1M] = {"1m", 60, 1440},
+    [HISTORY_15M] = {"15m", 900, 672},
+    [HISTORY_1H] = {"1h", 3600, 720},
+};
+
+struct history_tier
+{
+    uint32_t resolution; /* s */
+    uint32_t capacity;   /* records */
+    uint32_t offset;     /* File offset of the first record */
+    uint32_t head;       /* Next slot */
+    uint32_t count;      /* Valid records */
+
+    /* Bucket being filled */
+    uint32_t start;
+    uint32_t n;
+    uint32_t sum_mv;
+    uint32_t sum_soc;
+    uint32_t charging;
+    uint16_t min_mv;
+    uint16_t max_mv;
+};
+
+struct history_file
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t tiers;
+    uint32_t size;
+    uint32_t reserved;
+    struct history_tier tier[__HISTORY_TIER_MAX];
+};
+
+static struct history_file *g_file = NULL;
+static size_t g_size = 0;
+static int g_simulated = 0;
+
+static size_t history_size(void)
+{
+    size_t size = sizeof(struct history_file);
+
+    for (int i = 0; i < __HISTORY_TIER_MAX; i++) {
+        size += tier_layout[i].capacity * sizeof(struct history_record);
+    }
+    return size;
+}
+
+static int history_valid(const struct history_file *f, size_t size)
+{
+    uint32_t offset = sizeof(struct history_file);
+
+    if (f->magic != HISTORY_MAGIC || f->version != HISTORY_VERSION ||
+        f->tiers != __HISTORY_TIER_MAX || f->size != size) {
+        return 0;
+    }
+
+    /* Ring indexes are used as they are, a torn file must not point outside */
+    for (int i = 0; i < __HISTORY_TIER_MAX; i++) {
+        const struct history_tier *tier = &f->tier[i];
+        if (tier->resolution != tier_layout[i].resolution || tier->capacity != tier_layout[i].capacity ||
+            tier->offset != offset || tier->head >= tier->capacity || tier->count > tier->capacity ||
+            (tier->n && tier->min_mv > tier->max_mv)) {
+            return 0;
+        }
+        offset += tier->capacity * sizeof(struct history_record);
+    }
+    return 1;
+}
+
+static void history_init(void)
+{
+    uint32_t offset = sizeof(struct history_file);
+
+    memset(g_file, 0, g_size);
+    g_file->magic = HISTORY_MAGIC;
+    g_file->version = HISTORY_VERSION;
+    g_file->tiers = __HISTORY_TIER_MAX;
+    g_file->size = g_size;
+    for (int i = 0; i < __HISTORY_TIER_MAX; i++) {
+        g_file->tier[i].resolution = tier_layout[i].resolution;
+        g_file->tier[i].capacity = tier_layout[i].capacity;
+        g_file->tier[i].offset = offset;
+        offset += tier_layout[i].capacity * sizeof(struct history_record);
+    }
+}
+
+/* Load the flash copy into the mapping, 0 if it was usable */
+static int history_restore(void)
+{
+    FILE *f = fopen(HISTORY_CHECKPOINT_PATH, "r");
+    int ok;
+
+    if (!f) {
+        return -1;
+    }
+    ok = fread(g_file, 1, g_size, f) == g_size && fgetc(f) == EOF && history_valid(g_file, g_size);
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+int history_start(int simulated)
+{
+    const char *path = simulated ? HISTORY_SIM_PATH : HISTORY_PATH;
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    g_size = history_size();
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != g_size) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, g_size) < 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    map = mmap(NULL, g_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    g_file = map;
+    g_simulated = simulated;
+
+    /* A daemon restart keeps the tmpfs file, a reboot falls back to flash */
+    if (!history_valid(g_file, g_size) && (simulated || history_restore() < 0)) {
+        history_init();
+    }
+    return 0;
+}
+
+/* Wall clock s, ahead by as much as the emulator has sped up the daemon clock */
+static uint32_t history_time(void)
+{
+    return time(NULL) + mirror_ahead() / 1000;
+}
+
+static struct history_record *history_slot(const struct history_tier *tier, uint32_t index)
+{
+    return (struct history_record *)((uint8_t *)g_file + tier->offset) + index % tier->capacity;
+}
+
+static void history_push(struct history_tier *tier)
+{
+    struct history_record *rec = history_slot(tier, tier->head);
+
+    rec->t = tier->start;
+    rec->min_mv = tier->min_mv;
+    rec->max_mv = tier->max_mv;
+    rec->avg_mv = tier->sum_mv / tier->n;
+    rec->soc = tier->sum_soc / tier->n;
+    rec->charge = tier->charging * 100 / tier->n;
+
+    tier->head = (tier->head + 1) % tier->capacity;
+    if (tier->count < tier->capacity) {
+        tier->count++;
+    }
+}
+
+void history_add(uint16_t mv, uint8_t soc, int charging)
+{
+    uint32_t now = history_time();
+
+    if (!g_file) {
+        return;
+    }
+
+    for (int i = 0; i < __HISTORY_TIER_MAX; i++) {
+        struct history_tier *tier = &g_file->tier[i];
+
+        /* Bucket over, or the clock was set back */
+        if (tier->n && (now >= tier->start + tier->resolution || now < tier->start)) {
+            history_push(tier);
+            tier->n = 0;
+        }
+        if (!tier->n) {
+            tier->start = now - now % tier->resolution;
+            tier->sum_mv = 0;
+            tier->sum_soc = 0;
+            tier->charging = 0;
+            tier->min_mv = UINT16_MAX;
+            tier->max_mv = 0;
+        }
+
+        tier->n++;
+        tier->sum_mv += mv;
+        tier->sum_soc += soc;
+        tier->charging += !!charging;
+        if (mv < tier->min_mv) {
+            tier->min_mv = mv;
+        }
+        if (mv > tier->max_mv) {
+            tier->max_mv = mv;
+        }
+    }
+}
+
+int history_checkpoint(void)
+{
+    const char *tmp = HISTORY_CHECKPOINT_PATH ".tmp";
+    FILE *f;
+
+    if (!g_file) {
+        return -1;
+    }
+    if (g_simulated) {
+        return 0;
+    }
+    if (!(f = fopen(tmp, "w"))) {
+        return -1;
+    }
+
+    int ok = fwrite(g_file, 1, g_size, f) == g_size && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp, HISTORY_CHECKPOINT_PATH) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void history_stop(void)
+{
+    if (!g_file) {
+        return;
+    }
+    if (history_checkpoint() < 0) {
+        fprintf(stderr, "Failed to write %s\n", HISTORY_CHECKPOINT_PATH);
+    }
+    munmap(g_file, g_size);
+    g_file = NULL;
+}
+
+/* Finest tier that holds the window in at most HISTORY_POINTS_MAX records */
+static int history_pick(uint32_t window)
+{
+    for (int i = 0; i < __HISTORY_TIER_MAX; i++) {
+        const struct history_tier *tier = &g_file->tier[i];
+        if (tier->resolution * tier->capacity >= window && window / tier->resolution <= HISTORY_POINTS_MAX) {
+            return i;
+        }
+    }
+    return __HISTORY_TIER_MAX - 1;
+}
+
+static void history_point(struct blob_buf *b, const struct history_record *rec)
+{
+    void *point = blobmsg_open_array(b, NULL);
+    blobmsg_add_u32(b, NULL, rec->t);
+    blobmsg_add_u32(b, NULL, rec->min_mv);
+    blobmsg_add_u32(b, NULL, rec->avg_mv);
+    blobmsg_add_u32(b, NULL, rec->max_mv);
+    blobmsg_add_u32(b, NULL, rec->soc);
+    blobmsg_add_u32(b, NULL, rec->charge);
+    blobmsg_close_array(b, point);
+}
+
+void history_blob(struct blob_buf *b, uint32_t window)
+{
+    uint32_t now = history_time();
+    uint32_t from = window < now ? now - window : 0;
+    uint16_t min = UINT16_MAX;
+    uint16_t max = 0;
+    uint64_t sum = 0;
+    uint32_t n = 0;
+    void *points;
+
+    if (!g_file) {
+        return;
+    }
+
+    int id = history_pick(window);
+    const struct history_tier *tier = &g_file->tier[id];
+    uint32_t first = tier->head + tier->capacity - tier->count;
+
+    /* The coarsest tier can hold more records than a reply, merge them */
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < tier->count; k++) {
+        const struct history_record *rec = history_slot(tier, first + k);
+        total += rec->t >= from && rec->t <= now;
+    }
+    uint32_t step = total > HISTORY_POINTS_MAX ? (total + HISTORY_POINTS_MAX - 1) / HISTORY_POINTS_MAX : 1;
+
+    blobmsg_add_string(b, "tier", tier_layout[id].name);
+    blobmsg_add_u32(b, "resolution", tier->resolution * step);
+    blobmsg_add_u32(b, "window", window);
+
+    /* Oldest first, @step records per point starting at the oldest one */
+    struct history_record acc = {0};
+    uint32_t acc_avg = 0, acc_soc = 0, acc_charge = 0, acc_n = 0;
+    points = blobmsg_open_array(b, "points");
+    for (uint32_t k = 0; k < tier->count; k++) {
+        const struct history_record *rec = history_slot(tier, first + k);
+        if (rec->t < from || rec->t > now) {
+            continue;
+        }
+
+        min = rec->min_mv < min ? rec->min_mv : min;
+        max = rec->max_mv > max ? rec->max_mv : max;
+        sum += rec->avg_mv;
+        n++;
+
+        if (!acc_n) {
+            acc = *rec;
+            acc_avg = acc_soc = acc_charge = 0;
+        }
+        acc.min_mv = rec->min_mv < acc.min_mv ? rec->min_mv : acc.min_mv;
+        acc.max_mv = rec->max_mv > acc.max_mv ? rec->max_mv : acc.max_mv;
+        acc_avg += rec->avg_mv;
+        acc_soc += rec->soc;
+        acc_charge += rec->charge;
+
+        if (++acc_n == step || n == total) {
+            acc.avg_mv = acc_avg / acc_n;
+            acc.soc = acc_soc / acc_n;
+            acc.charge = acc_charge / acc_n;
+            history_point(b, &acc);
+            acc_n = 0;
+        }
+    }
+    blobmsg_close_array(b, points);
+
+    if (n) {
+        blobmsg_add_u32(b, "min", min);
+        blobmsg_add_u32(b, "avg", sum / n);
+        blobmsg_add_u32(b, "max", max);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <libubox/blobmsg.h>
+#include <stdint.h>
+
+/* Memory-mapped ring file, lost with a reboot */
+#define HISTORY_PATH "/tmp/pmic.history"
+
+/* Ring file of an emulated or replayed battery, never checkpointed */
+#define HISTORY_SIM_PATH "/tmp/pmic.history.sim"
+
+/* Flash copy the ring file is restored from after a reboot */
+#define HISTORY_CHECKPOINT_PATH "/etc/pmic.history"
+
+/* Flash checkpoint interval, ms */
+#define HISTORY_CHECKPOINT_INTERVAL (6 * 3600 * 1000)
+
+/* Most records returned by the history method */
+#define HISTORY_POINTS_MAX 240
+
+/*
+ * Downsampling tiers, finest first. Every sample is folded into the
+ * current bucket of each tier, a bucket becomes a record once its
+ * resolution has passed.
+ */
+enum history_tier_id
+{
+    HISTORY_RAW,  /* 5 s, 1 hour */
+    HISTORY_1M,   /* 1 min, 1 day */
+    HISTORY_15M,  /* 15 min, 1 week */
+    HISTORY_1H,   /* 1 h, 30 days */
+    __HISTORY_TIER_MAX,
+};
+
+struct history_record
+{
+    uint32_t t;      /* Wall clock s, start of the bucket */
+    uint16_t min_mv;
+    uint16_t avg_mv;
+    uint16_t max_mv;
+    uint8_t soc;     /* Average, percent */
+    uint8_t charge;  /* Share of samples while charging, percent */
+};
+
+/*
+ * Map HISTORY_PATH, restored from the checkpoint if it does not exist yet.
+ * A @simulated battery, with timestamps ahead of the wall clock, goes to
+ * HISTORY_SIM_PATH and never touches the checkpoint.
+ */
+int history_start(int simulated);
+
+/* Add a battery sample */
+void history_add(uint16_t mv, uint8_t soc, int charging);
+
+/* Copy the ring file to HISTORY_CHECKPOINT_PATH, a no-op when simulated */
+int history_checkpoint(void);
+
+/* Checkpoint and unmap */
+void history_stop(void);
+
+/*
+ * Add min/avg/max over the last @window s and the records they come from
+ * to a ubus reply. The finest tier that covers the window within
+ * HISTORY_POINTS_MAX records is used, raw samples are never scanned for
+ * long windows. Beyond the coarsest tier's limit, consecutive records are
+ * merged so that at most HISTORY_POINTS_MAX points are returned.
+ */
+void history_blob(struct blob_buf *b, uint32_t window);
+
+#endif
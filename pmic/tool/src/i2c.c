@@ -8,29 +8,36 @@
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 
+#include <linux/i2c.h>
+
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
+#include "emu.h"
 #include "i2c.h"
+#include "replay.h"
+#include "trace.h"
 
 /*
- * Start the I2C device.
+ * Open the bus device and select the slave address.
  *
- * @param dev points to the I2C device to be started, must have filename and addr populated
+ * @param dev points to the I2C device to be started
+ * @param bus path of the i2c-dev device
  *
  * @return - 0 if the starting procedure succeeded
  *         - negative if the starting procedure failed
  */
-int i2c_start(struct I2cDevice* dev) {
+static int i2c_open(struct I2cDevice* dev, const char *bus) {
 	int fd;
 	int rc;
 
 	/*
 	 * Open the given I2C bus filename.
 	 */
-	fd = open(dev->filename, O_RDWR);
+	fd = open(bus, O_RDWR);
 	if (fd < 0) {
 		rc = fd;
 		goto fail_open;
@@ -55,6 +62,13 @@ fail_open:
 
 }
 
+static void i2c_close(struct I2cDevice* dev) {
+	/*
+	 * Close the I2C bus file descriptor.
+	 */
+	close(dev->fd);
+}
+
 /*
  * Read data from the I2C device.
  *
@@ -85,40 +99,226 @@ int i2c_write(struct I2cDevice* dev, uint8_t *buf, size_t buf_len) {
 	return write(dev->fd, buf, buf_len);
 }
 
+/*
+ * Append the messages of one register transfer to a message set. A read is
+ * the register address followed by a repeated START and the data, a write
+ * is a single message with the register address in front of the data.
+ *
+ * @param dev points to the I2C device to be accessed
+ * @param xfer the register transfer to append
+ * @param msgs points to the next free messages, room for two is required
+ * @param wbuf scratch buffer of I2C_XFER_MAX + 1 bytes for a write
+ *
+ * @return - number of messages appended
+ *         - -EINVAL if the transfer is too long
+ */
+static int i2c_xfer_msgs(struct I2cDevice* dev, struct i2c_xfer *xfer,
+		struct i2c_msg *msgs, uint8_t *wbuf) {
+	if (xfer->len == 0 || xfer->len > I2C_XFER_MAX) {
+		return -EINVAL;
+	}
+
+	if (xfer->write) {
+		wbuf[0] = xfer->reg;
+		memcpy(wbuf + 1, xfer->buf, xfer->len);
+
+		msgs[0].addr = dev->addr;
+		msgs[0].flags = 0;
+		msgs[0].len = xfer->len + 1;
+		msgs[0].buf = wbuf;
+		return 1;
+	}
+
+	msgs[0].addr = dev->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &xfer->reg;
+
+	msgs[1].addr = dev->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = xfer->len;
+	msgs[1].buf = xfer->buf;
+	return 2;
+}
+
+/*
+ * Submit a message set as one combined transaction.
+ *
+ * @param dev points to the I2C device to be accessed
+ * @param msgs points to the messages
+ * @param nmsgs number of messages
+ *
+ * @return - 0 if the transaction succeeded
+ *         - negative errno if the transaction failed
+ */
+static int i2c_rdwr(struct I2cDevice* dev, struct i2c_msg *msgs, int nmsgs) {
+	struct i2c_rdwr_ioctl_data data = {
+		.msgs = msgs,
+		.nmsgs = nmsgs,
+	};
+
+	if (ioctl(dev->fd, I2C_RDWR, &data) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * i2c-dev transport: all transfers in one I2C_RDWR ioctl, with repeated
+ * STARTs in between and a single STOP at the end.
+ */
+static int i2cdev_xfer(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count) {
+	uint8_t wbuf[I2C_BATCH_MAX][I2C_XFER_MAX + 1];
+	struct i2c_msg msgs[I2C_BATCH_MAX * 2];
+	int nmsgs = 0;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < count; i++) {
+		rc = i2c_xfer_msgs(dev, &xfers[i], &msgs[nmsgs], wbuf[i]);
+		if (rc < 0) {
+			return rc;
+		}
+		nmsgs += rc;
+	}
+
+	return i2c_rdwr(dev, msgs, nmsgs);
+}
+
+/*
+ * SMBus transport for adapters without plain I2C, like i2c-stub: one I2C
+ * block transfer per register transfer. A batch is not atomic here, other
+ * bus users may get in between.
+ */
+static int smbus_xfer(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count) {
+	union i2c_smbus_data data;
+	struct i2c_smbus_ioctl_data args = {
+		.size = I2C_SMBUS_I2C_BLOCK_DATA,
+		.data = &data,
+	};
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (xfers[i].len == 0 || xfers[i].len > I2C_SMBUS_BLOCK_MAX) {
+			return -EINVAL;
+		}
+
+		args.read_write = xfers[i].write ? I2C_SMBUS_WRITE : I2C_SMBUS_READ;
+		args.command = xfers[i].reg;
+		data.block[0] = xfers[i].len;
+		if (xfers[i].write) {
+			memcpy(&data.block[1], xfers[i].buf, xfers[i].len);
+		}
+
+		if (ioctl(dev->fd, I2C_SMBUS, &args) < 0) {
+			return -errno;
+		}
+
+		if (!xfers[i].write) {
+			memcpy(xfers[i].buf, &data.block[1], xfers[i].len);
+		}
+	}
+
+	return 0;
+}
+
+static const struct i2c_ops i2cdev_ops = {
+	.prefix = NULL,
+	.start = i2c_open,
+	.xfer = i2cdev_xfer,
+	.stop = i2c_close,
+};
+
+static const struct i2c_ops smbus_ops = {
+	.prefix = "stub:",
+	.start = i2c_open,
+	.xfer = smbus_xfer,
+	.stop = i2c_close,
+};
+
+static const struct i2c_ops *const i2c_transports[] = {
+	&smbus_ops,
+	&emu_ops,
+	&replay_ops,
+};
+
+/*
+ * Run transfers on the transport, recorded if a capture is open.
+ *
+ * @param dev points to the I2C device to be accessed
+ * @param xfers points to the transfers
+ * @param count number of transfers
+ *
+ * @return - 0 if the transaction succeeded
+ *         - negative errno if the transaction failed
+ */
+static int i2c_submit(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count) {
+	uint64_t start;
+	int rc;
+
+	if (!dev->trace) {
+		return dev->ops->xfer(dev, xfers, count);
+	}
+
+	start = trace_clock();
+	rc = dev->ops->xfer(dev, xfers, count);
+	trace_write(dev->trace, xfers, count, rc, start);
+
+	return rc;
+}
+
+/*
+ * Start the I2C device.
+ *
+ * @param dev points to the I2C device to be started, must have filename and addr populated
+ *
+ * @return - 0 if the starting procedure succeeded
+ *         - negative if the starting procedure failed
+ */
+int i2c_start(struct I2cDevice* dev) {
+	const char *bus = dev->filename;
+	size_t i;
+
+	dev->fd = -1;
+	dev->ops = &i2cdev_ops;
+	for (i = 0; i < sizeof(i2c_transports) / sizeof(i2c_transports[0]); i++) {
+		size_t len = strlen(i2c_transports[i]->prefix);
+		if (strncmp(bus, i2c_transports[i]->prefix, len) == 0) {
+			dev->ops = i2c_transports[i];
+			bus += len;
+			break;
+		}
+	}
+
+	return dev->ops->start(dev, bus);
+}
+
 /*
  * Read data from a register of the I2C device.
  *
+ * The register address and the data phase are joined by a repeated START,
+ * so no other bus user can move the register pointer in between.
+ *
  * @param dev points to the I2C device to be read from
  * @param reg the register to read from
  * @param buf points to the start of buffer to be read into
- * @param buf_len length of the buffer to be read
+ * @param buf_len length of the buffer to be read, at most I2C_XFER_MAX
  *
  * @return - number of bytes read if the read procedure succeeded
- *         - 0 if no bytes were read
- *         - negative if the read procedure failed
+ *         - negative errno if the read procedure failed
  */
 int i2c_readn_reg(struct I2cDevice* dev, uint8_t reg, uint8_t *buf, size_t buf_len) {
+	struct i2c_xfer xfer = { .reg = reg, .write = 0, .buf = buf, .len = buf_len };
 	int rc;
 
-	/*
-	 * Write the I2C register address.
-	 */
-	rc = i2c_write(dev, &reg, 1);
-	if (rc <= 0) {
-		printf("%s: failed to write i2c register address\r\n", __func__);
-		return rc;
-	}
-
-	/*
-	 * Read the I2C register data.
-	 */
-	rc = i2c_read(dev, buf, buf_len);
-	if (rc <= 0) {
-		printf("%s: failed to read i2c register data\r\n", __func__);
+	rc = i2c_submit(dev, &xfer, 1);
+	if (rc < 0) {
+		fprintf(stderr, "%s: failed to read i2c register %u: %d\r\n", __func__, reg, rc);
 		return rc;
 	}
 
-	return rc;
+	return buf_len;
 }
 
 /*
@@ -127,44 +327,51 @@ int i2c_readn_reg(struct I2cDevice* dev, uint8_t reg, uint8_t *buf, size_t buf_l
  * @param dev points to the I2C device to be written to
  * @param reg the register to write to
  * @param buf points to the start of buffer to be written from
- * @param buf_len length of the buffer to be written
+ * @param buf_len length of the buffer to be written, at most I2C_XFER_MAX
  *
- * @return - number of bytes written if the write procedure succeeded
- *         - 0 if no bytes were written
- *         - negative if the write procedure failed
+ * @return - 0 if the write procedure succeeded
+ *         - negative errno if the write procedure failed
  */
 int i2c_writen_reg(struct I2cDevice* dev, uint8_t reg, uint8_t *buf, size_t buf_len) {
-	uint8_t *full_buf;
-	int full_buf_len;
+	struct i2c_xfer xfer = { .reg = reg, .write = 1, .buf = buf, .len = buf_len };
 	int rc;
-	size_t i;
 
-	/*
-	 * Allocate a buffer that also contains the register address as
-	 * the first element.
-	 */
-	full_buf_len = buf_len + 1;
-	full_buf = malloc(sizeof(uint8_t) * full_buf_len);
-
-	full_buf[0] = reg;
-	for (i = 0; i < buf_len; i++) {
-		full_buf[i + 1] = buf[i];
+	rc = i2c_submit(dev, &xfer, 1);
+	if (rc < 0) {
+		fprintf(stderr, "%s: failed to write i2c register %u: %d\r\n", __func__, reg, rc);
+		return rc;
 	}
 
-	/*
-	 * Write the I2C register address and data.
-	 */
-	rc = i2c_write(dev, full_buf, full_buf_len);
-	if (rc <= 0) {
-		printf("%s: failed to write i2c register address and data\r\n", __func__);
-		goto fail_send;
+	return 0;
+}
+
+/*
+ * Submit several register reads and writes as one combined transaction.
+ *
+ * The transfers are executed in order. On i2c-dev they go out with repeated
+ * STARTs in between and a single STOP at the end, all within one I2C_RDWR
+ * ioctl; the SMBus transport issues them one by one.
+ *
+ * @param dev points to the I2C device to be accessed
+ * @param xfers points to the transfers
+ * @param count number of transfers, at most I2C_BATCH_MAX
+ *
+ * @return - 0 if all transfers succeeded
+ *         - negative errno if the transaction failed, no transfer is
+ *           reported as done in that case
+ */
+int i2c_batch(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count) {
+	int rc;
+
+	if (count == 0 || count > I2C_BATCH_MAX) {
+		return -EINVAL;
 	}
 
-	free(full_buf);
-	return 0;
+	rc = i2c_submit(dev, xfers, count);
+	if (rc < 0) {
+		fprintf(stderr, "%s: failed to transfer %zu i2c register blocks: %d\r\n", __func__, count, rc);
+	}
 
-fail_send:
-	free(full_buf);
 	return rc;
 }
 
@@ -190,9 +397,8 @@ uint8_t i2c_read_reg(struct I2cDevice* dev, uint8_t reg) {
  * @param reg the register to write to
  * @param value the value to write to the register
  *
- * @return - number of bytes written if the write procedure succeeded
- *         - 0 if no bytes were written
- *         - negative if the write procedure failed
+ * @return - 0 if the write procedure succeeded
+ *         - negative errno if the write procedure failed
  */
 int i2c_write_reg(struct I2cDevice* dev, uint8_t reg, uint8_t value) {
 	return i2c_writen_reg(dev, reg, &value, 1);
@@ -205,23 +411,20 @@ int i2c_write_reg(struct I2cDevice* dev, uint8_t reg, uint8_t value) {
  * @param reg the register to write to
  * @param mask the mask to apply to the register
  *
- * @return - number of bytes written if the write procedure succeeded
- *         - 0 if no bytes were written
- *         - negative if the write procedure failed
+ * @return - 0 if the mask procedure succeeded
+ *         - negative errno if the mask procedure failed
  */
 int i2c_mask_reg(struct I2cDevice* dev, uint8_t reg, uint8_t mask) {
 	uint8_t value = 0;
 	int rc;
 
-	value = i2c_read_reg(dev, reg);
-	value |= mask;
-
-	rc = i2c_write_reg(dev, reg, value);
-	if (rc <= 0) {
+	rc = i2c_readn_reg(dev, reg, &value, 1);
+	if (rc < 0) {
 		return rc;
 	}
+	value |= mask;
 
-	return 0;
+	return i2c_write_reg(dev, reg, value);
 }
 
 /*
@@ -230,8 +433,5 @@ int i2c_mask_reg(struct I2cDevice* dev, uint8_t reg, uint8_t mask) {
  * @param dev points to the I2C device to be stopped
  */
 void i2c_stop(struct I2cDevice* dev) {
-	/*
-	 * Close the I2C bus file descriptor.
-	 */
-	close(dev->fd);
+	dev->ops->stop(dev);
 }
@@ -5,19 +5,62 @@
  * @author Cosmin Tanislav
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef SRC_I2C_H_
 #define SRC_I2C_H_
 
+/*
+ * Largest register payload of a single transfer, register writes are
+ * assembled on the stack.
+ */
+#define I2C_XFER_MAX 32
+
+/*
+ * Largest number of transfers in one i2c_batch() call.
+ */
+#define I2C_BATCH_MAX 8
+
+/*
+ * One register transfer of a batch.
+ */
+struct i2c_xfer {
+	uint8_t reg; /**< First register */
+	uint8_t write; /**< Non-zero to write buf to reg, read into buf otherwise */
+	uint8_t *buf; /**< Data to write or buffer to read into */
+	size_t len; /**< Number of registers, at most I2C_XFER_MAX */
+};
+
+struct I2cDevice;
+struct trace;
+
+/*
+ * Transport behind an I2C device, picked by i2c_start() from the bus name:
+ *
+ *   /dev/i2c-0         - i2c-dev, combined I2C_RDWR transactions
+ *   stub:/dev/i2c-5    - SMBus I2C block transfers, for the i2c-stub module
+ *   emu:speed=60,...   - in-process PMIC emulator, see emu.c
+ *   replay:FILE,...    - plays back a capture, see replay.c
+ */
+struct i2c_ops {
+	const char *prefix; /**< Bus name prefix, NULL for the default */
+	uint8_t simulated; /**< No real PMIC or host power behind it, see pmic_simulated() */
+	int (*start)(struct I2cDevice* dev, const char *bus);
+	int (*xfer)(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count);
+	void (*stop)(struct I2cDevice* dev);
+};
+
 /*
  * Configuration for the I2C device.
  */
 struct I2cDevice {
-	char* filename; /**< Path of the I2C bus, eg: /dev/i2c-0 */
+	char* filename; /**< Bus name, eg: /dev/i2c-0, see struct i2c_ops */
 	uint16_t addr; /**< Address of the I2C slave, eg: 0x48 */
 
-	int fd; /**< File descriptor for the I2C bus */
+	int fd; /**< File descriptor for the I2C bus, -1 for the emulator */
+	const struct i2c_ops *ops; /**< Set by i2c_start() */
+	struct trace *trace; /**< Capture of every transaction, see trace_open(), NULL if off */
 };
 
 int i2c_start(struct I2cDevice* dev);
@@ -27,6 +70,7 @@ int i2c_readn_reg(struct I2cDevice* dev, uint8_t reg, uint8_t *buf, size_t buf_l
 int i2c_writen_reg(struct I2cDevice* dev, uint8_t reg, uint8_t *buf, size_t buf_len);
 uint8_t i2c_read_reg(struct I2cDevice* dev, uint8_t reg);
 int i2c_write_reg(struct I2cDevice* dev, uint8_t reg, uint8_t value);
+int i2c_batch(struct I2cDevice* dev, struct i2c_xfer *xfers, size_t count);
 int i2c_mask_reg(struct I2cDevice* dev, uint8_t reg, uint8_t mask);
 void i2c_stop(struct I2cDevice* dev);
 
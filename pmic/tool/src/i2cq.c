@@ -0,0 +1,368 @@
+/*
+ * i2cq.c - I2C I/O worker
+ *
+ * All bus traffic of the daemon runs on one worker thread fed by a
+ * priority queue, so a slow or NAKing bus never blocks uloop and ubus.
+ * Finished jobs are handed back to uloop through an eventfd.
+ *
+ * Failed jobs are retried a bounded number of times with a doubling
+ * delay; after I2CQ_RECOVER_AFTER failed jobs in a row the bus device is
+ * reopened. That clears a wedged file descriptor, not a wedged bus: i2c-dev
+ * has no way to toggle SCL, so a slave holding SDA low is only freed by an
+ * adapter driver that implements bus recovery.
+ */
+
+#include <errno.h>
+#include <libubox/uloop.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "i2cq.h"
+#include "metrics.h"
+#include "mirror.h"
+
+static struct I2cDevice *g_dev = NULL;
+static pthread_t g_thread;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head g_pending[__I2CQ_PRIO_MAX];
+static struct list_head g_done;
+static int g_running = 0;
+static struct i2cq_health g_health;
+
+static const char *const err_names[__I2CQ_ERR_MAX] = {
+    [I2CQ_ERR_NAK] = "nak",
+    [I2CQ_ERR_TIMEOUT] = "timeout",
+    [I2CQ_ERR_BUS] = "bus",
+    [I2CQ_ERR_DEVICE] = "device",
+};
+
+static void i2cq_event_cb(struct uloop_fd *u, unsigned int events);
+
+static struct uloop_fd event_fd = {
+    .cb = i2cq_event_cb,
+    .fd = -1,
+};
+
+struct i2cq_job *i2cq_job_new(uint8_t prio, i2cq_done_cb done, void *priv)
+{
+    struct i2cq_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        return NULL;
+    }
+
+    job->prio = prio < __I2CQ_PRIO_MAX ? prio : I2CQ_PRIO_LED;
+    job->autofree = 1;
+    job->done = done;
+    job->priv = priv;
+    return job;
+}
+
+int i2cq_job_add(struct i2cq_job *job, uint8_t reg, const void *data, uint8_t len)
+{
+    if (job->count >= I2C_BATCH_MAX || len == 0 || reg + len > PMIC_REG_COUNT) {
+        return -EINVAL;
+    }
+
+    struct i2c_xfer *xfer = &job->xfers[job->count++];
+    xfer->reg = reg;
+    xfer->write = data != NULL;
+    xfer->buf = job->buf + reg;
+    xfer->len = len;
+    if (data) {
+        memcpy(xfer->buf, data, len);
+    }
+    return 0;
+}
+
+/* Caller holds g_lock */
+static void i2cq_complete_locked(struct i2cq_job *job)
+{
+    uint64_t one = 1;
+
+    list_add_tail(&job->list, &g_done);
+    if (write(event_fd.fd, &one, sizeof(one)) < 0) {
+        perror("i2cq: eventfd");
+    }
+}
+
+static int i2cq_same_regs(const struct i2cq_job *a, const struct i2cq_job *b)
+{
+    if (a->count != b->count) {
+        return 0;
+    }
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->xfers[i].reg != b->xfers[i].reg || a->xfers[i].len != b->xfers[i].len ||
+            !a->xfers[i].write || !b->xfers[i].write) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int i2cq_submit(struct i2cq_job *job)
+{
+    struct i2cq_job *queued;
+
+    if (!g_running || job->count == 0) {
+        return -EINVAL;
+    }
+    job->submitted = metrics_us();
+
+    pthread_mutex_lock(&g_lock);
+
+    /* Last writer wins, the new data replaces the one still waiting */
+    if (job->coalesce) {
+        list_for_each_entry(queued, &g_pending[job->prio], list) {
+            if (queued->coalesce && i2cq_same_regs(queued, job)) {
+                memcpy(queued->buf, job->buf, sizeof(job->buf));
+                job->rc = 0;
+                i2cq_complete_locked(job);
+                pthread_mutex_unlock(&g_lock);
+                return 0;
+            }
+        }
+    }
+
+    list_add_tail(&job->list, &g_pending[job->prio]);
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+int i2cq_classify(int rc)
+{
+    switch (-rc) {
+    case ENXIO:
+    case EREMOTEIO:
+        return I2CQ_ERR_NAK;
+    case ETIMEDOUT:
+        return I2CQ_ERR_TIMEOUT;
+    case EBADF:
+    case ENODEV:
+    case ENOENT:
+    case EOPNOTSUPP:
+        return I2CQ_ERR_DEVICE;
+    case EAGAIN: /* Arbitration lost, Documentation/i2c/fault-codes.rst */
+    default:
+        return I2CQ_ERR_BUS;
+    }
+}
+
+const char *i2cq_err_name(int cls)
+{
+    return cls >= 0 && cls < __I2CQ_ERR_MAX ? err_names[cls] : "unknown";
+}
+
+void i2cq_health_get(struct i2cq_health *health)
+{
+    pthread_mutex_lock(&g_lock);
+    *health = g_health;
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* Reopen the bus device, @failed being the count read under g_lock */
+static void i2cq_recover(uint32_t failed)
+{
+    fprintf(stderr, "i2cq: %u failed transactions, recovering the bus\n", failed);
+    i2c_stop(g_dev);
+    g_dev->fd = -1;
+    if (i2c_start(g_dev) < 0) {
+        /* Next job fails with EBADF and lands here again */
+        g_dev->fd = -1;
+        perror("i2cq: reopen");
+    }
+}
+
+/* Latency histogram of a job, by the direction of its transfers */
+static enum metric_hist i2cq_job_hist(const struct i2cq_job *job)
+{
+    size_t writes = 0;
+
+    for (size_t i = 0; i < job->count; i++) {
+        writes += job->xfers[i].write;
+    }
+    return !writes ? METRIC_I2C_READ : writes == job->count ? METRIC_I2C_WRITE : METRIC_I2C_MIXED;
+}
+
+/* Run a job with bounded retries, worker context, g_lock not held */
+static int i2cq_run(struct i2cq_job *job)
+{
+    uint64_t start = metrics_us();
+    int rc;
+
+    metrics_observe(METRIC_I2C_QUEUE, start - job->submitted);
+
+    for (int attempt = 0;; attempt++) {
+        rc = i2c_batch(g_dev, job->xfers, job->count);
+        if (rc == 0) {
+            break;
+        }
+
+        int cls = i2cq_classify(rc);
+        pthread_mutex_lock(&g_lock);
+        g_health.errors[cls]++;
+        g_health.last_error = rc;
+        pthread_mutex_unlock(&g_lock);
+
+        /* A dead device does not come back by retrying, recovery reopens it */
+        if (attempt >= I2CQ_RETRIES || cls == I2CQ_ERR_DEVICE) {
+            break;
+        }
+        usleep(I2CQ_RETRY_US << attempt);
+
+        pthread_mutex_lock(&g_lock);
+        g_health.retries++;
+        pthread_mutex_unlock(&g_lock);
+    }
+
+    metrics_observe(i2cq_job_hist(job), metrics_us() - start);
+    return rc;
+}
+
+/* Caller holds g_lock */
+static struct i2cq_job *i2cq_next_locked(void)
+{
+    for (int prio = 0; prio < __I2CQ_PRIO_MAX; prio++) {
+        if (!list_empty(&g_pending[prio])) {
+            struct i2cq_job *job = list_first_entry(&g_pending[prio], struct i2cq_job, list);
+            list_del(&job->list);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void *i2cq_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&g_lock);
+    while (g_running) {
+        struct i2cq_job *job = i2cq_next_locked();
+        if (!job) {
+            pthread_cond_wait(&g_cond, &g_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&g_lock);
+        int rc = job->rc = i2cq_run(job);
+        pthread_mutex_lock(&g_lock);
+
+        g_health.jobs++;
+        if (rc == 0) {
+            g_health.consecutive = 0;
+            g_health.last_ok = mirror_now();
+        } else {
+            g_health.failed++;
+            g_health.consecutive++;
+        }
+        /* The job belongs to uloop from here on */
+        i2cq_complete_locked(job);
+
+        if (rc < 0 && g_health.consecutive % I2CQ_RECOVER_AFTER == 0) {
+            uint32_t failed = g_health.consecutive;
+
+            g_health.recoveries++;
+            pthread_mutex_unlock(&g_lock);
+            i2cq_recover(failed);
+            pthread_mutex_lock(&g_lock);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static void i2cq_event_cb(struct uloop_fd *u, unsigned int events)
+{
+    (void)events;
+    uint64_t cnt;
+    LIST_HEAD(done);
+
+    if (read(u->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        perror("i2cq: eventfd");
+    }
+
+    /* Callbacks may submit again, so run them outside of the lock */
+    pthread_mutex_lock(&g_lock);
+    list_splice_init(&g_done, &done);
+    pthread_mutex_unlock(&g_lock);
+
+    while (!list_empty(&done)) {
+        struct i2cq_job *job = list_first_entry(&done, struct i2cq_job, list);
+        list_del(&job->list);
+
+        uint8_t autofree = job->autofree;
+        if (job->done) {
+            job->done(job);
+        }
+        if (autofree) {
+            free(job);
+        }
+    }
+}
+
+int i2cq_start(struct I2cDevice *dev)
+{
+    g_dev = dev;
+    for (int prio = 0; prio < __I2CQ_PRIO_MAX; prio++) {
+        INIT_LIST_HEAD(&g_pending[prio]);
+    }
+    INIT_LIST_HEAD(&g_done);
+    memset(&g_health, 0, sizeof(g_health));
+
+    event_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd.fd < 0) {
+        perror("i2cq: eventfd");
+        return -1;
+    }
+    uloop_fd_add(&event_fd, ULOOP_READ);
+
+    g_running = 1;
+    if (pthread_create(&g_thread, NULL, i2cq_worker, NULL) != 0) {
+        fprintf(stderr, "i2cq: failed to start the I2C worker\n");
+        g_running = 0;
+        uloop_fd_delete(&event_fd);
+        close(event_fd.fd);
+        event_fd.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void i2cq_drop(struct list_head *list)
+{
+    while (!list_empty(list)) {
+        struct i2cq_job *job = list_first_entry(list, struct i2cq_job, list);
+        list_del(&job->list);
+        if (job->autofree) {
+            free(job);
+        }
+    }
+}
+
+void i2cq_stop(void)
+{
+    if (!g_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    g_running = 0;
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+    pthread_join(g_thread, NULL);
+
+    for (int prio = 0; prio < __I2CQ_PRIO_MAX; prio++) {
+        i2cq_drop(&g_pending[prio]);
+    }
+    i2cq_drop(&g_done);
+
+    uloop_fd_delete(&event_fd);
+    close(event_fd.fd);
+    event_fd.fd = -1;
+}
@@ -0,0 +1,95 @@
+#ifndef __I2CQ_H
+#define __I2CQ_H
+
+#include <libubox/list.h>
+#include <stdint.h>
+
+#include "i2c.h"
+#include "pmic_regs.h"
+
+/* Queue priorities, a lower value is always served first */
+enum i2cq_prio
+{
+    I2CQ_PRIO_URGENT, /* Shutdown, heartbeat and button state */
+    I2CQ_PRIO_POLL,   /* Telemetry polls and configuration */
+    I2CQ_PRIO_LED,    /* LED writes, coalesced */
+    __I2CQ_PRIO_MAX,
+};
+
+/* Error classes of a failed transaction */
+enum i2cq_err
+{
+    I2CQ_ERR_NAK,     /* Address or data NAK, PMIC busy or absent */
+    I2CQ_ERR_TIMEOUT, /* Controller timeout, SDA/SCL held low */
+    I2CQ_ERR_BUS,     /* Arbitration loss or other bus error */
+    I2CQ_ERR_DEVICE,  /* Bus device unusable, needs a reopen */
+    __I2CQ_ERR_MAX,
+};
+
+/* Immediate retries of a failed job, backoff doubles from I2CQ_RETRY_US */
+#define I2CQ_RETRIES 2
+#define I2CQ_RETRY_US 500
+
+/* Consecutive failed jobs before the bus device is reopened */
+#define I2CQ_RECOVER_AFTER 3
+
+struct i2cq_health
+{
+    uint32_t jobs;                    /* Completed jobs */
+    uint32_t failed;                  /* Jobs failed after all retries */
+    uint32_t retries;
+    uint32_t recoveries;
+    uint32_t errors[__I2CQ_ERR_MAX];  /* Failed attempts per class */
+    uint32_t consecutive;             /* Failed jobs since the last success */
+    int last_error;                   /* Negative errno, 0 - none yet */
+    uint64_t last_ok;                 /* mirror_now() of the last success, 0 - never */
+};
+
+struct i2cq_job;
+
+/* Called from uloop once the worker has run the job */
+typedef void (*i2cq_done_cb)(struct i2cq_job *job);
+
+/*
+ * One combined I2C transaction. Transfer data lives in buf at the offset of
+ * its register, so a read lands in a register image of the PMIC.
+ */
+struct i2cq_job
+{
+    struct list_head list;
+    uint8_t prio;
+    uint8_t coalesce;  /* A queued job writing the same registers is updated instead */
+    uint8_t autofree;  /* Freed after done(), set by i2cq_job_new() */
+    size_t count;
+    struct i2c_xfer xfers[I2C_BATCH_MAX];
+    uint8_t buf[PMIC_REG_COUNT];
+    int rc;            /* 0 or negative errno, valid in done() */
+    uint64_t submitted; /* metrics_us() at i2cq_submit() */
+    i2cq_done_cb done; /* May be NULL */
+    void *priv;
+};
+
+/* Allocate a job that is freed once it completes */
+struct i2cq_job *i2cq_job_new(uint8_t prio, i2cq_done_cb done, void *priv);
+
+/* Append a register read (data NULL) or write to a job */
+int i2cq_job_add(struct i2cq_job *job, uint8_t reg, const void *data, uint8_t len);
+
+/* Start the I/O worker, it owns the device until i2cq_stop() */
+int i2cq_start(struct I2cDevice *dev);
+
+/* Queue a job, done() is then called exactly once; not at all on an error */
+int i2cq_submit(struct i2cq_job *job);
+
+/* Map a negative errno to enum i2cq_err */
+int i2cq_classify(int rc);
+
+const char *i2cq_err_name(int cls);
+
+/* Snapshot of the bus health counters */
+void i2cq_health_get(struct i2cq_health *health);
+
+/* Stop the worker, queued jobs are dropped without done() */
+void i2cq_stop(void);
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * metrics.c - Daemon counters and latency histograms
+ *
+ * Histograms have fixed log2 buckets of microseconds, an update is a few
+ * adds under an uncontended mutex, so the I2C worker records its own
+ * transactions. 64-bit atomics would need libatomic on 32-bit MIPS. Exported as a ubus reply and as a Prometheus
+ * text file.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "i2cq.h"
+#include "metrics.h"
+#include "poll.h"
+
+struct metric_histogram
+{
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum; /* us */
+};
+
+static const struct
+{
+    const char *name;  /* Prometheus metric, seconds */
+    const char *label; /* Value of its type label, NULL - none */
+    const char *key;   /* ubus reply */
+} hist_names[__METRIC_HIST_MAX] = {
+    [METRIC_I2C_READ] = {"pmic_i2c_job_seconds", "read", "i2c-read"},
+    [METRIC_I2C_WRITE] = {"pmic_i2c_job_seconds", "write", "i2c-write"},
+    [METRIC_I2C_MIXED] = {"pmic_i2c_job_seconds", "mixed", "i2c-mixed"},
+    [METRIC_I2C_QUEUE] = {"pmic_i2c_queue_seconds", NULL, "i2c-queue"},
+    [METRIC_UBUS_CALL] = {"pmic_ubus_call_seconds", NULL, "ubus-call"},
+    [METRIC_NOTIFY] = {"pmic_notify_seconds", NULL, "notify"},
+};
+
+static struct metric_histogram g_hist[__METRIC_HIST_MAX];
+static pthread_mutex_t g_hist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ubus calls per method, uloop only */
+static struct
+{
+    char name[32];
+    uint64_t calls;
+    uint64_t sum; /* us */
+} g_methods[METRICS_METHODS_MAX];
+
+uint64_t metrics_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_observe(enum metric_hist hist, uint64_t us)
+{
+    struct metric_histogram *h = &g_hist[hist];
+    int bucket = us > 1 ? 64 - __builtin_clzll(us - 1) : 0;
+
+    if (bucket >= METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS - 1;
+    }
+    pthread_mutex_lock(&g_hist_lock);
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += us;
+    pthread_mutex_unlock(&g_hist_lock);
+}
+
+void metrics_method(const char *method, uint64_t us)
+{
+    metrics_observe(METRIC_UBUS_CALL, us);
+
+    for (int i = 0; i < METRICS_METHODS_MAX; i++) {
+        if (!g_methods[i].name[0]) {
+            snprintf(g_methods[i].name, sizeof(g_methods[i].name), "%s", method);
+        } else if (strcmp(g_methods[i].name, method) != 0) {
+            continue;
+        }
+        g_methods[i].calls++;
+        g_methods[i].sum += us;
+        return;
+    }
+}
+
+static void metrics_snapshot(struct metric_histogram *out, enum metric_hist hist)
+{
+    pthread_mutex_lock(&g_hist_lock);
+    *out = g_hist[hist];
+    pthread_mutex_unlock(&g_hist_lock);
+}
+
+/* Upper bound of the bucket holding the quantile, us */
+static uint64_t metrics_quantile(const struct metric_histogram *h, unsigned int permille)
+{
+    uint64_t rank = (h->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && seen) {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (METRICS_BUCKETS - 1);
+}
+
+static void metrics_cpu(uint64_t *user_us, uint64_t *system_us, struct rusage *ru)
+{
+    getrusage(RUSAGE_SELF, ru);
+    *user_us = (uint64_t)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+    *system_us = (uint64_t)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+}
+
+void metrics_blob(struct blob_buf *b)
+{
+    struct metric_histogram h;
+    struct i2cq_health health;
+    struct rusage ru;
+    uint64_t user_us, system_us;
+    void *tbl, *entry;
+
+    i2cq_health_get(&health);
+    metrics_cpu(&user_us, &system_us, &ru);
+
+    blobmsg_add_u64(b, "cpu-user-us", user_us);
+    blobmsg_add_u64(b, "cpu-system-us", system_us);
+    blobmsg_add_u64(b, "context-switches", ru.ru_nvcsw + ru.ru_nivcsw);
+    blobmsg_add_u32(b, "wakeups-per-minute", poll_wakeups_per_minute());
+    blobmsg_add_u32(b, "i2c-jobs", health.jobs);
+    blobmsg_add_u32(b, "i2c-failed", health.failed);
+    blobmsg_add_u32(b, "i2c-retries", health.retries);
+
+    tbl = blobmsg_open_table(b, "latency");
+    for (int i = 0; i < __METRIC_HIST_MAX; i++) {
+        metrics_snapshot(&h, i);
+        entry = blobmsg_open_table(b, hist_names[i].key);
+        blobmsg_add_u64(b, "count", h.count);
+        blobmsg_add_u64(b, "sum-us", h.sum);
+        if (h.count) {
+            blobmsg_add_u64(b, "p50-us", metrics_quantile(&h, 500));
+            blobmsg_add_u64(b, "p99-us", metrics_quantile(&h, 990));
+        }
+        blobmsg_close_table(b, entry);
+    }
+    blobmsg_close_table(b, tbl);
+
+    tbl = blobmsg_open_table(b, "methods");
+    for (int i = 0; i < METRICS_METHODS_MAX && g_methods[i].name[0]; i++) {
+        entry = blobmsg_open_table(b, g_methods[i].name);
+        blobmsg_add_u64(b, "calls", g_methods[i].calls);
+        blobmsg_add_u64(b, "sum-us", g_methods[i].sum);
+        blobmsg_close_table(b, entry);
+    }
+    blobmsg_close_table(b, tbl);
+}
+
+static void metrics_write_hist(FILE *f, enum metric_hist hist)
+{
+    struct metric_histogram h;
+    char label[32] = "";
+    uint64_t cumulative = 0;
+
+    metrics_snapshot(&h, hist);
+    if (hist_names[hist].label) {
+        snprintf(label, sizeof(label), "type=\"%s\",", hist_names[hist].label);
+    }
+
+    /* TYPE once per metric, the labelled variants follow each other */
+    if (hist == 0 || strcmp(hist_names[hist - 1].name, hist_names[hist].name) != 0) {
+        fprintf(f, "# TYPE %s histogram\n", hist_names[hist].name);
+    }
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+        cumulative += h.buckets[i];
+        fprintf(f, "%s_bucket{%sle=\"%g\"} %llu\n", hist_names[hist].name, label,
+                (double)(1ull << i) / 1e6, (unsigned long long)cumulative);
+    }
+    fprintf(f, "%s_bucket{%sle=\"+Inf\"} %llu\n", hist_names[hist].name, label, (unsigned long long)h.count);
+
+    /* Drop the trailing comma, an empty label set stays valid */
+    if (label[0]) {
+        label[strlen(label) - 1] = '\0';
+    }
+    fprintf(f, "%s_sum{%s} %g\n", hist_names[hist].name, label, (double)h.sum / 1e6);
+    fprintf(f, "%s_count{%s} %llu\n", hist_names[hist].name, label, (unsigned long long)h.count);
+}
+
+int metrics_write(void)
+{
+    const char *tmp = METRICS_PROM_PATH ".tmp";
+    struct i2cq_health health;
+    struct rusage ru;
+    uint64_t user_us, system_us;
+    FILE *f = fopen(tmp, "w");
+
+    if (!f) {
+        return -1;
+    }
+    i2cq_health_get(&health);
+    metrics_cpu(&user_us, &system_us, &ru);
+
+    fprintf(f, "# TYPE pmic_cpu_seconds_total counter\n");
+    fprintf(f, "pmic_cpu_seconds_total{mode=\"user\"} %g\n", (double)user_us / 1e6);
+    fprintf(f, "pmic_cpu_seconds_total{mode=\"system\"} %g\n", (double)system_us / 1e6);
+    fprintf(f, "# TYPE pmic_context_switches_total counter\n");
+    fprintf(f, "pmic_context_switches_total{kind=\"voluntary\"} %ld\n", ru.ru_nvcsw);
+    fprintf(f, "pmic_context_switches_total{kind=\"involuntary\"} %ld\n", ru.ru_nivcsw);
+    fprintf(f, "# TYPE pmic_poll_wakeups_per_minute gauge\n");
+    fprintf(f, "pmic_poll_wakeups_per_minute %u\n", poll_wakeups_per_minute());
+
+    fprintf(f, "# TYPE pmic_i2c_jobs_total counter\n");
+    fprintf(f, "pmic_i2c_jobs_total %u\n", health.jobs);
+    fprintf(f, "# TYPE pmic_i2c_failed_total counter\n");
+    fprintf(f, "pmic_i2c_failed_total %u\n", health.failed);
+    fprintf(f, "# TYPE pmic_i2c_retries_total counter\n");
+    fprintf(f, "pmic_i2c_retries_total %u\n", health.retries);
+    fprintf(f, "# TYPE pmic_i2c_recoveries_total counter\n");
+    fprintf(f, "pmic_i2c_recoveries_total %u\n", health.recoveries);
+    fprintf(f, "# TYPE pmic_i2c_errors_total counter\n");
+    for (int i = 0; i < __I2CQ_ERR_MAX; i++) {
+        fprintf(f, "pmic_i2c_errors_total{class=\"%s\"} %u\n", i2cq_err_name(i), health.errors[i]);
+    }
+
+    for (int i = 0; i < __METRIC_HIST_MAX; i++) {
+        metrics_write_hist(f, i);
+    }
+
+    fprintf(f, "# TYPE pmic_ubus_calls_total counter\n");
+    for (int i = 0; i < METRICS_METHODS_MAX && g_methods[i].name[0]; i++) {
+        fprintf(f, "pmic_ubus_calls_total{method=\"%s\"} %llu\n", g_methods[i].name,
+                (unsigned long long)g_methods[i].calls);
+    }
+
+    if (fclose(f) != 0 || rename(tmp, METRICS_PROM_PATH) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <libubox/blobmsg.h>
+#include <stdint.h>
+
+/* Prometheus text file, for the node_exporter textfile collector or a plain cat */
+#define METRICS_PROM_PATH "/var/run/pmic.prom"
+
+/* Rewrite interval of METRICS_PROM_PATH, ms */
+#define METRICS_INTERVAL 15000
+
+/* log2 latency buckets, bucket n counts samples up to 2^n us, the last one is unbounded */
+#define METRICS_BUCKETS 20
+
+/* Distinct ubus methods with their own counters */
+#define METRICS_METHODS_MAX 16
+
+/* Latency histograms, safe to update from the I2C worker */
+enum metric_hist
+{
+    METRIC_I2C_READ,  /* I2C job of reads only, retries included */
+    METRIC_I2C_WRITE, /* I2C job of writes only */
+    METRIC_I2C_MIXED, /* I2C job of reads and writes */
+    METRIC_I2C_QUEUE, /* Submit to start of an I2C job */
+    METRIC_UBUS_CALL, /* ubus method handler */
+    METRIC_NOTIFY,    /* Building and sending one notification */
+    __METRIC_HIST_MAX,
+};
+
+/* Monotonic time in us */
+uint64_t metrics_us(void);
+
+/* Add a latency sample */
+void metrics_observe(enum metric_hist hist, uint64_t us);
+
+/* Add a ubus call of @method, also counted in METRIC_UBUS_CALL */
+void metrics_method(const char *method, uint64_t us);
+
+/* Add all metrics to a ubus reply */
+void metrics_blob(struct blob_buf *b);
+
+/* Write METRICS_PROM_PATH, replaced atomically */
+int metrics_write(void);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * mirror.c - Daemon copy of the PMIC register map
+ *
+ * Every register read goes through the mirror, so the latest values and
+ * their age can be served without touching the bus.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "mirror.h"
+
+static struct pmic_regs g_regs;
+static uint64_t g_stamp[PMIC_REG_COUNT]; /* mirror_now() of the last refresh, 0 - never */
+static uint32_t g_updates[PMIC_REG_COUNT];
+static uint32_t g_speed = 1;
+static uint64_t g_real_base;   /* Monotonic ms the speed was last set at */
+static uint64_t g_scaled_base; /* mirror_now() at that point */
+
+uint64_t mirror_real(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t mirror_now(void)
+{
+    return g_scaled_base + (mirror_real() - g_real_base) * g_speed;
+}
+
+void mirror_set_speed(uint32_t speed)
+{
+    /* Continue from the current time, the clock never goes back */
+    g_scaled_base = mirror_now();
+    g_real_base = mirror_real();
+    g_speed = speed ? speed : 1;
+}
+
+uint32_t mirror_speed(void)
+{
+    return g_speed;
+}
+
+int64_t mirror_ahead(void)
+{
+    return (int64_t)(mirror_now() - mirror_real());
+}
+
+static void mirror_stamp(uint8_t first, uint8_t count)
+{
+    /* Never 0, that marks a register as not read yet */
+    uint64_t now = mirror_now() + 1;
+    for (uint8_t i = first; i < first + count; i++) {
+        g_stamp[i] = now;
+        g_updates[i]++;
+    }
+}
+
+int mirror_refresh(struct I2cDevice *dev, uint8_t first, uint8_t count)
+{
+    uint8_t buf[PMIC_REG_COUNT];
+
+    if (count == 0 || first + count > PMIC_REG_COUNT) {
+        return -1;
+    }
+
+    int rc = i2c_readn_reg(dev, first, buf, count);
+    if (rc <= 0) {
+        return rc < 0 ? rc : -1;
+    }
+
+    memcpy((uint8_t *)&g_regs + first, buf, count);
+    mirror_stamp(first, count);
+    return 0;
+}
+
+void mirror_store(uint8_t first, const void *buf, uint8_t count)
+{
+    if (first + count > PMIC_REG_COUNT) {
+        return;
+    }
+    memcpy((uint8_t *)&g_regs + first, buf, count);
+    mirror_stamp(first, count);
+}
+
+const struct pmic_regs *mirror_regs(void)
+{
+    return &g_regs;
+}
+
+uint32_t mirror_age(uint8_t reg)
+{
+    if (reg >= PMIC_REG_COUNT || g_stamp[reg] == 0) {
+        return MIRROR_AGE_NEVER;
+    }
+    return (uint32_t)(mirror_now() + 1 - g_stamp[reg]);
+}
+
+uint32_t mirror_updates(uint8_t reg)
+{
+    return reg < PMIC_REG_COUNT ? g_updates[reg] : 0;
+}
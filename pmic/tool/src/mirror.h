@@ -0,0 +1,49 @@
+#ifndef __MIRROR_H
+#define __MIRROR_H
+
+#include <stdint.h>
+
+#include "i2c.h"
+#include "pmic_regs.h"
+
+/* Age of a register that has never been read */
+#define MIRROR_AGE_NEVER UINT32_MAX
+
+/* Monotonic time in ms, runs mirror_speed() times faster than real time */
+uint64_t mirror_now(void);
+
+/* CLOCK_MONOTONIC ms, unscaled, for times read by other processes */
+uint64_t mirror_real(void);
+
+/*
+ * Run the daemon clock @speed times faster, for the emulator. Intervals
+ * and ages stay in daemon ms, only the timers armed on uloop are scaled.
+ */
+void mirror_set_speed(uint32_t speed);
+
+/* Current clock speed-up, 1 - real time */
+uint32_t mirror_speed(void);
+
+/* ms mirror_now() has run ahead of the real monotonic clock */
+int64_t mirror_ahead(void);
+
+/*
+ * Refresh registers first..first+count-1 with a single burst read. On
+ * failure the mirror and its stamps are left untouched. Blocking, only
+ * for use before the I2C worker is started.
+ */
+int mirror_refresh(struct I2cDevice *dev, uint8_t first, uint8_t count);
+
+/* Record registers read by the I2C worker or written by the daemon */
+void mirror_store(uint8_t first, const void *buf, uint8_t count);
+
+/* Last known register values */
+const struct pmic_regs *mirror_regs(void);
+
+/* ms since the register was last read or written, MIRROR_AGE_NEVER if never */
+uint32_t mirror_age(uint8_t reg);
+
+/* Number of times the register was refreshed, tells two reads apart */
+uint32_t mirror_updates(uint8_t reg);
+
+#endif
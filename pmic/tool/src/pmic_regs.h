@@ -0,0 +1,133 @@
+/*
+ * pmic_regs.h - PMIC I2C register map
+ *
+ * Shared by the CH32V003 firmware (pmic/fw) and pmicctrl, the OpenWrt
+ * package only ships pmic/tool/src so the header lives here. Both sides
+ * are little-endian, so a burst read lands directly in struct pmic_regs.
+ *
+ * @see doc/pmic-register-map.md
+ */
+
+#ifndef PMIC_REGS_H
+#define PMIC_REGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "struct pmic_regs is decoded in place, little-endian hosts only"
+#endif
+
+#define PMIC_I2C_ADDR 0x09
+#define PMIC_REG_COUNT 32
+
+/* Bumped whenever the register layout or semantics change, 0 - legacy firmware */
+#define PMIC_PROTO_VERSION 1
+
+/* Capability bits, register caps */
+#define PMIC_CAP_HEARTBEAT    (1 << 0) /* hb / hb_limit watchdog */
+#define PMIC_CAP_PWR_POLICY   (1 << 1) /* pwr_policy / pwr_on_src */
+#define PMIC_CAP_SD_HANDSHAKE (1 << 2) /* sd_req / sd_deadline */
+#define PMIC_CAP_BOOTLOADER   (1 << 3) /* off = PMIC_OFF_BOOTLOADER */
+#define PMIC_CAP_BTN_LATCH    (1 << 4) /* in_state pwr_evt */
+
+/* Values of the off register */
+#define PMIC_OFF_SHUTDOWN   0xff
+#define PMIC_OFF_BOOTLOADER 0xb0
+
+/* Power-on policy, selects what brings the host up while it is off */
+#define PMIC_PWR_POLICY_BUTTON  0 /* Button press only */
+#define PMIC_PWR_POLICY_CHARGER 1 /* Button or charger insertion */
+#define PMIC_PWR_POLICY_BATTERY 2 /* Button or battery recovered above ~3.8v */
+#define PMIC_PWR_POLICY_ALWAYS  3 /* Immediately, unless the host asked to be turned off */
+
+/* What turned the host on last time */
+#define PMIC_PWR_ON_SRC_BUTTON  1
+#define PMIC_PWR_ON_SRC_CHARGER 2
+#define PMIC_PWR_ON_SRC_BATTERY 3
+#define PMIC_PWR_ON_SRC_ALWAYS  4
+#define PMIC_PWR_ON_SRC_IWDG    5
+#define PMIC_PWR_ON_SRC_HB      6 /* Power-cycled after missed heartbeats */
+
+/* ms between battery samples while the host is on, adc changes at multiples of tm */
+#define PMIC_ADC_INTERVAL 5000
+
+/* Reset cause bits, register rst_cause */
+#define PMIC_RST_CAUSE_POR  (1 << 0) /* PMIC power-on reset */
+#define PMIC_RST_CAUSE_PIN  (1 << 1) /* PMIC NRST pin */
+#define PMIC_RST_CAUSE_IWDG (1 << 2) /* PMIC independent watchdog */
+#define PMIC_RST_CAUSE_SW   (1 << 3) /* PMIC software reset */
+#define PMIC_RST_CAUSE_HB   (1 << 4) /* Host power-cycled after missed heartbeats */
+
+typedef union
+{
+    uint8_t raw;
+    struct
+    {
+        uint8_t charge : 1;  /* TP4056 CHRG pin, 0 - charging */
+        uint8_t stdby : 1;   /* TP4056 STDBY pin, 0 - charged */
+        uint8_t lte : 1;     /* wwan/wpan/wlan LED */
+        uint8_t pwr : 1;     /* Power button pin, 0 - pressed */
+        uint8_t bat_low : 1; /* Battery below ~3.5v */
+        uint8_t sd_req : 1;  /* Shutdown requested, see sd_deadline */
+        uint8_t pwr_evt : 1; /* Button pressed since in_state was last read */
+        uint8_t : 1;
+    };
+} pmic_in_state_t;
+
+struct pmic_regs
+{
+    uint8_t version;          /* 0: PMIC_PROTO_VERSION, read-only */
+    uint8_t caps;             /* 1: PMIC_CAP_*, read-only */
+    uint8_t sd_deadline;      /* 2: s until power is cut after sd_req */
+    uint8_t pwr_policy;       /* 3: PMIC_PWR_POLICY_* */
+    uint32_t tm;              /* 4: ms since the host was powered on */
+    uint8_t led_g;            /* 8: WS2812 wire order is G, R, B */
+    uint8_t led_r;            /* 9 */
+    uint8_t led_b;            /* 10 */
+    uint8_t led_upd;          /* 11: non-zero - apply led_r/g/b */
+    uint16_t adc;             /* 12: battery ADC, 10 bit */
+    pmic_in_state_t in_state; /* 14 */
+    uint8_t rst_cause;        /* 15: PMIC_RST_CAUSE_* */
+    uint8_t uid[12];          /* 16: CH32V003 unique ID */
+    uint8_t hb;               /* 28: host heartbeat */
+    uint8_t hb_limit;         /* 29: missed heartbeats before power-cycle, 0 - off */
+    uint8_t pwr_on_src;       /* 30: PMIC_PWR_ON_SRC_* */
+    uint8_t off;              /* 31: PMIC_OFF_* */
+} __attribute__((packed));
+
+#define PMIC_REG(field) ((uint8_t)offsetof(struct pmic_regs, field))
+
+#define PMIC_REG_VERSION     PMIC_REG(version)
+#define PMIC_REG_CAPS        PMIC_REG(caps)
+#define PMIC_REG_SD_DEADLINE PMIC_REG(sd_deadline)
+#define PMIC_REG_PWR_POLICY  PMIC_REG(pwr_policy)
+#define PMIC_REG_TM          PMIC_REG(tm)
+#define PMIC_REG_LED_G       PMIC_REG(led_g)
+#define PMIC_REG_LED_R       PMIC_REG(led_r)
+#define PMIC_REG_LED_B       PMIC_REG(led_b)
+#define PMIC_REG_LED_UPD     PMIC_REG(led_upd)
+#define PMIC_REG_ADC         PMIC_REG(adc)
+#define PMIC_REG_IN_STATE    PMIC_REG(in_state)
+#define PMIC_REG_RST_CAUSE   PMIC_REG(rst_cause)
+#define PMIC_REG_UID         PMIC_REG(uid)
+#define PMIC_REG_HB          PMIC_REG(hb)
+#define PMIC_REG_HB_LIMIT    PMIC_REG(hb_limit)
+#define PMIC_REG_PWR_ON_SRC  PMIC_REG(pwr_on_src)
+#define PMIC_REG_OFF         PMIC_REG(off)
+
+_Static_assert(sizeof(pmic_in_state_t) == 1, "in_state must be one register");
+_Static_assert(sizeof(struct pmic_regs) == PMIC_REG_COUNT, "register map must be 32 bytes");
+_Static_assert(offsetof(struct pmic_regs, sd_deadline) == 2, "sd_deadline moved");
+_Static_assert(offsetof(struct pmic_regs, pwr_policy) == 3, "pwr_policy moved");
+_Static_assert(offsetof(struct pmic_regs, tm) == 4, "tm moved");
+_Static_assert(offsetof(struct pmic_regs, led_g) == 8, "led_g moved");
+_Static_assert(offsetof(struct pmic_regs, led_upd) == 11, "led_upd moved");
+_Static_assert(offsetof(struct pmic_regs, adc) == 12, "adc moved");
+_Static_assert(offsetof(struct pmic_regs, in_state) == 14, "in_state moved");
+_Static_assert(offsetof(struct pmic_regs, rst_cause) == 15, "rst_cause moved");
+_Static_assert(offsetof(struct pmic_regs, uid) == 16, "uid moved");
+_Static_assert(offsetof(struct pmic_regs, hb) == 28, "hb moved");
+_Static_assert(offsetof(struct pmic_regs, off) == 31, "off moved");
+
+#endif /* PMIC_REGS_H */
@@ -0,0 +1,121 @@
+/*
+ * pmic_shm.h - PMIC status page published by `pmicctrl daemon`
+ *
+ * The daemon keeps its decoded PMIC state in a fixed-layout page under
+ * /dev/shm, guarded by a sequence lock. Readers map it once and then get
+ * a consistent snapshot without any syscall:
+ *
+ *   const struct pmic_shm *shm = pmic_shm_open();
+ *   struct pmic_shm st;
+ *   if (shm && pmic_shm_read(shm, &st) == 0)
+ *       printf("%u mV\n", st.mv);
+ *
+ * Header-only, needs nothing but libc.
+ */
+
+#ifndef PMIC_SHM_H
+#define PMIC_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pmic_regs.h"
+
+#define PMIC_SHM_PATH "/dev/shm/pmic"
+#define PMIC_SHM_MAGIC 0x434d5050 /* "PPMC" */
+
+/* Bumped whenever struct pmic_shm changes */
+#define PMIC_SHM_VERSION 1
+
+/* Snapshot attempts while the daemon keeps writing */
+#define PMIC_SHM_RETRIES 64
+
+struct pmic_shm
+{
+    uint32_t magic;          /* PMIC_SHM_MAGIC */
+    uint16_t version;        /* PMIC_SHM_VERSION */
+    uint16_t size;           /* sizeof(struct pmic_shm) */
+    uint32_t seq;            /* Odd while the daemon writes */
+    uint32_t pid;            /* Publishing daemon */
+    uint64_t updated;        /* CLOCK_MONOTONIC ms of the last update */
+    uint32_t mv;             /* Battery voltage */
+    uint8_t soc;             /* Rough state of charge, percent */
+    uint8_t charge;          /* 1 - charging */
+    uint8_t standby;         /* 1 - charged, TP4056 in standby */
+    uint8_t power;           /* Power button, 1 - pressed */
+    uint8_t lte;             /* wwan/wpan/wlan LED */
+    uint8_t battery_low;     /* Battery below ~3.5v */
+    uint8_t shutdown_request;/* PMIC cuts power after the deadline */
+    uint8_t flags;           /* Raw in_state */
+    uint32_t bus_failed;     /* I2C jobs failed after all retries */
+    uint32_t bus_recoveries; /* I2C bus recoveries */
+    struct pmic_regs regs;   /* Daemon register mirror */
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct pmic_shm) == 80, "status page layout changed");
+
+/* Map the status page read-only, NULL with errno set if the daemon never ran */
+static inline const struct pmic_shm *pmic_shm_open(void)
+{
+    struct stat st;
+    void *page;
+    int fd = open(PMIC_SHM_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* Mapping past the end of a short file faults on access */
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct pmic_shm)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    page = mmap(NULL, sizeof(struct pmic_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct pmic_shm *shm = page;
+    if (shm->magic != PMIC_SHM_MAGIC || shm->version != PMIC_SHM_VERSION) {
+        munmap(page, sizeof(struct pmic_shm));
+        errno = EPROTO;
+        return NULL;
+    }
+    return shm;
+}
+
+/* Copy a consistent snapshot, -1 with errno EAGAIN if it never settled */
+static inline int pmic_shm_read(const struct pmic_shm *shm, struct pmic_shm *out)
+{
+    for (int i = 0; i < PMIC_SHM_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        memcpy(out, (const void *)shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static inline void pmic_shm_close(const struct pmic_shm *shm)
+{
+    munmap((void *)shm, sizeof(struct pmic_shm));
+}
+
+#endif /* PMIC_SHM_H */
@@ -0,0 +1,51 @@
+/*
+ * pmic_telemetry.h - Binary telemetry stream of `pmicctrl daemon`
+ *
+ * Clients connect a SOCK_SEQPACKET socket to PMIC_TELEMETRY_PATH and send
+ * a struct pmic_telemetry_req, again at any time to change it. The daemon
+ * then sends one packet per sample: a struct pmic_telemetry_hdr followed
+ * by one uint32_t per requested field, in ascending field order. Samples
+ * a client does not read in time are dropped and counted in the header,
+ * the daemon never waits for a client.
+ */
+
+#ifndef PMIC_TELEMETRY_H
+#define PMIC_TELEMETRY_H
+
+#include <stdint.h>
+
+#define PMIC_TELEMETRY_PATH "/var/run/pmic.sock"
+#define PMIC_TELEMETRY_MAGIC 0x544d5050 /* "PPMT" */
+
+/* Fastest sample rate, 50 Hz */
+#define PMIC_TELEMETRY_MIN_INTERVAL 20
+
+enum pmic_telemetry_field
+{
+    PMIC_TELEMETRY_TIME,           /* CLOCK_MONOTONIC ms of the sample, low 32 bits */
+    PMIC_TELEMETRY_MV,             /* Battery voltage */
+    PMIC_TELEMETRY_ADC,            /* Raw battery ADC */
+    PMIC_TELEMETRY_SOC,            /* Rough state of charge, percent */
+    PMIC_TELEMETRY_FLAGS,          /* Raw in_state */
+    PMIC_TELEMETRY_PMIC_TM,        /* PMIC ms since host power-on */
+    PMIC_TELEMETRY_LED,            /* 0x00RRGGBB */
+    PMIC_TELEMETRY_AGE,            /* ms since the ADC was read */
+    PMIC_TELEMETRY_BUS_FAILED,     /* I2C jobs failed after all retries */
+    PMIC_TELEMETRY_BUS_RECOVERIES, /* I2C bus recoveries */
+    __PMIC_TELEMETRY_MAX,
+};
+
+struct pmic_telemetry_req
+{
+    uint32_t magic;    /* PMIC_TELEMETRY_MAGIC */
+    uint32_t interval; /* ms, raised to PMIC_TELEMETRY_MIN_INTERVAL */
+    uint32_t fields;   /* 1 << PMIC_TELEMETRY_*, 0 - pause */
+};
+
+struct pmic_telemetry_hdr
+{
+    uint32_t seq;     /* Samples taken for this client, sent or dropped */
+    uint32_t dropped; /* Samples dropped since the client connected */
+};
+
+#endif /* PMIC_TELEMETRY_H */
@@ -7,11 +7,20 @@
  *
  * Supported commands:
  *   read [--json]        - Read PMIC registers and display values.
+ *   peek [--json]        - Print the daemon's status page, no bus or ubus access.
  *   set-led <R> <G> <B>   - Immediately set the LED color.
  *   shutdown             - Send shutdown command via I²C.
+ *   bench [-n N] [--json] [--bus DEV] [--addr A]
+ *                        - Measure I²C latency, throughput and error rate.
  *   daemon               - Run as a daemon: poll power-button and handle ubus requests.
+ *   replay <file> [--speed N] [--dump]
+ *                        - Run the daemon against a bus capture, or print it.
  *   version              - Print version information.
  *
+ * While the daemon is running, read/set-led/shutdown are proxied to it over
+ * ubus (reads are answered from its register mirror), so the daemon stays
+ * the only bus master. Without a daemon they access the I2C bus directly.
+ *
  * Compile along with your i2c.c code.
  *
  */
@@ -23,21 +32,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bench.h"
 #include "i2c.h"
 #include "version.hpp"
+#include "config.h"
 #include "daemon.h"
-
-
-/* I2C bus and PMIC device definitions */
-#define I2C_BUS "/dev/i2c-0"
-#define PMIC_ADDR 0x09
-#define PMIC_REG_COUNT 32
+#include "mirror.h"
+#include "pmic_regs.h"
+#include "pmic_shm.h"
+#include "trace.h"
+#include "ubus.h"
 
 /* Function prototypes */
 void print_usage(const char *progname);
 int read_registers_text(struct I2cDevice *dev);
 int read_registers_json(struct I2cDevice *dev);
 int shutdown_device(struct I2cDevice *dev);
+int peek_status(int json);
 
 
 #define dbg() printf("%s:%d\r\n", __FILE__, __LINE__)
@@ -50,77 +61,193 @@ void print_usage(const char *progname)
     fprintf(stderr, "Usage: %s <command> [arguments]\n", progname);
     fprintf(stderr, "Commands:\n");
     fprintf(stderr, "  read [--json]        - Read PMIC registers and display values\n");
+    fprintf(stderr, "  peek [--json]        - Print the running daemon's status page\n");
     fprintf(stderr, "  set-led <R> <G> <B>   - Set LED color (each value in hex or decimal)\n");
     fprintf(stderr, "  shutdown             - Send shutdown command via I2C\n");
     fprintf(stderr, "  daemon               - Run daemon (polls power button and listens for ubus commands)\n");
+    fprintf(stderr, "  bench [-n N] [--json] [--bus DEV] [--addr A]\n");
+    fprintf(stderr, "                       - I2C latency percentiles, burst throughput and error rate\n");
+    fprintf(stderr, "  replay <file> [--speed N] [--dump]\n");
+    fprintf(stderr, "                       - Run the daemon on a capture from option trace, or print it\n");
     fprintf(stderr, "  version              - Print version information\n");
+    fprintf(stderr, "read, set-led and shutdown go through the daemon when it is running\n");
 }
 
-int read_registers_text(struct I2cDevice *dev)
+/* --- Daemon proxy, used when dev is NULL --- */
+enum
+{
+    REGS_HEX,
+    REGS_AGE,
+    __REGS_MAX,
+};
+
+static const struct blobmsg_policy regs_policy[__REGS_MAX] = {
+    [REGS_HEX] = {.name = "regs", .type = BLOBMSG_TYPE_STRING},
+    [REGS_AGE] = {.name = "age", .type = BLOBMSG_TYPE_INT32},
+};
+
+struct regs_reply
+{
+    struct pmic_regs *regs;
+    uint32_t age;
+    int ok;
+};
+
+static void regs_reply_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+    (void)type;
+    struct regs_reply *reply = req->priv;
+    struct blob_attr *tb[__REGS_MAX];
+
+    blobmsg_parse(regs_policy, __REGS_MAX, tb, blob_data(msg), blob_len(msg));
+    if (!tb[REGS_HEX]) {
+        return;
+    }
+
+    const char *hex = blobmsg_get_string(tb[REGS_HEX]);
+    uint8_t *raw = (uint8_t *)reply->regs;
+    if (strlen(hex) != PMIC_REG_COUNT * 2) {
+        return;
+    }
+    for (int i = 0; i < PMIC_REG_COUNT; i++) {
+        unsigned int v;
+        if (sscanf(&hex[i * 2], "%2x", &v) != 1) {
+            return;
+        }
+        raw[i] = v;
+    }
+
+    reply->age = tb[REGS_AGE] ? blobmsg_get_u32(tb[REGS_AGE]) : 0;
+    reply->ok = 1;
+}
+
+static int daemon_call(const char *method, struct blob_buf *b, pmicctrl_call_cb_t cb, void *priv)
+{
+    static struct blob_buf empty;
+
+    if (!b) {
+        blob_buf_init(&empty, 0);
+        b = &empty;
+    }
+
+    int rc = pmicctrl_invoke("pmic", method, b, cb, priv);
+    if (rc) {
+        fprintf(stderr, "ubus call pmic %s failed: %s\n", method, ubus_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+/* Age of the daemon's copy, printed by the read commands */
+static int64_t g_regs_age = -1;
+
+static int read_registers(struct I2cDevice *dev, struct pmic_regs *regs)
 {
-    uint8_t regs[PMIC_REG_COUNT];
-    int rc = i2c_readn_reg(dev, 0, regs, PMIC_REG_COUNT);
+    if (!dev) {
+        struct regs_reply reply = {.regs = regs};
+        if (daemon_call("regs", NULL, regs_reply_cb, &reply) < 0 || !reply.ok) {
+            fprintf(stderr, "Failed to read PMIC registers from the daemon\n");
+            return -1;
+        }
+        g_regs_age = reply.age;
+        return 0;
+    }
+
+    int rc = i2c_readn_reg(dev, 0, (uint8_t *)regs, sizeof(*regs));
     if (rc <= 0) {
         fprintf(stderr, "Failed to read PMIC registers\n");
         return -1;
     }
+    return 0;
+}
 
+int read_registers_text(struct I2cDevice *dev)
+{
+    struct pmic_regs regs;
+    if (read_registers(dev, &regs) < 0) {
+        return -1;
+    }
+
+    const uint8_t *raw = (const uint8_t *)&regs;
     printf("PMIC Register Dump:\n");
     for (int i = 0; i < PMIC_REG_COUNT; i++) {
-        printf(" Reg %2d: 0x%02x\n", i, regs[i]);
+        printf(" Reg %2d: 0x%02x\n", i, raw[i]);
     }
 
-    uint32_t tm = (regs[7] << 24) | (regs[6] << 16) | (regs[5] << 8) | regs[4];
-    uint16_t adc_val = (regs[13] << 8) | regs[12];
-    uint8_t in_state = regs[14];
-    float vbat = DIV_RATIO * (VREF * ((float)adc_val / ADC_MAX));
+    float vbat = config_get()->div_ratio * (config_get()->vref * ((float)regs.adc / ADC_MAX));
 
     printf("\nDecoded Fields:\n");
-    printf("  Time (ms): %u\n", tm);
+    printf("  Protocol: %u (capabilities 0x%02x)\n", regs.version, regs.caps);
+    printf("  Time (ms): %u\n", regs.tm);
     printf("  LED Color: R=0x%02x, G=0x%02x, B=0x%02x (trigger=0x%02x)\n",
-           regs[8], regs[9], regs[10], regs[11]);
-    printf("  ADC Value: %u\n", adc_val);
+           regs.led_r, regs.led_g, regs.led_b, regs.led_upd);
+    printf("  ADC Value: %u\n", regs.adc);
     printf("  Battery Voltage: %.3f V\n", vbat);
-    printf("  In-State : 0x%02x\n", in_state);
+    printf("  In-State : 0x%02x\n", regs.in_state.raw);
+    printf("  Reset Cause: 0x%02x\n", regs.rst_cause);
+    printf("  Power-on Policy: %u (source %u)\n", regs.pwr_policy, regs.pwr_on_src);
+    printf("  Heartbeat: %u (limit %u)\n", regs.hb, regs.hb_limit);
+    printf("  Shutdown Deadline: %u s\n", regs.sd_deadline);
+    if (g_regs_age >= 0) {
+        printf("  (pmicctrl daemon cache, %lld ms old)\n", (long long)g_regs_age);
+    }
 
     return 0;
 }
 
 int read_registers_json(struct I2cDevice *dev)
 {
-    uint8_t regs[PMIC_REG_COUNT];
-    int rc = i2c_readn_reg(dev, 0, regs, PMIC_REG_COUNT);
-    if (rc <= 0) {
-        fprintf(stderr, "Failed to read PMIC registers\n");
+    struct pmic_regs regs;
+    if (read_registers(dev, &regs) < 0) {
         return -1;
     }
 
-    uint32_t tm = (regs[7] << 24) | (regs[6] << 16) | (regs[5] << 8) | regs[4];
-    uint8_t r = regs[8], g = regs[9], b = regs[10], trigger = regs[11];
-    uint16_t adc_val = (regs[13] << 8) | regs[12];
-    uint8_t in_state = regs[14];
-    float vbat = DIV_RATIO * (VREF * ((float)adc_val / ADC_MAX));
+    float vbat = config_get()->div_ratio * (config_get()->vref * ((float)regs.adc / ADC_MAX));
 
     printf("{\n");
-    printf("  \"tm\": %u,\n", tm);
+    printf("  \"version\": %u,\n", regs.version);
+    printf("  \"caps\": %u,\n", regs.caps);
+    printf("  \"tm\": %u,\n", regs.tm);
     printf("  \"led_color\": {\n");
-    printf("    \"r\": %u,\n", r);
-    printf("    \"g\": %u,\n", g);
-    printf("    \"b\": %u,\n", b);
-    printf("    \"trigger\": %u\n", trigger);
+    printf("    \"r\": %u,\n", regs.led_r);
+    printf("    \"g\": %u,\n", regs.led_g);
+    printf("    \"b\": %u,\n", regs.led_b);
+    printf("    \"trigger\": %u\n", regs.led_upd);
     printf("  },\n");
-    printf("  \"adc_val\": %u,\n", adc_val);
+    printf("  \"adc_val\": %u,\n", regs.adc);
     printf("  \"vbat\": %.3f,\n", vbat);
-    printf("  \"in_state\": %u\n", in_state);
-    printf("}\n");
+    printf("  \"in_state\": %u,\n", regs.in_state.raw);
+    printf("  \"reset_cause\": %u,\n", regs.rst_cause);
+    printf("  \"power_policy\": %u,\n", regs.pwr_policy);
+    printf("  \"power_on_source\": %u,\n", regs.pwr_on_src);
+    printf("  \"heartbeat\": %u,\n", regs.hb);
+    printf("  \"heartbeat_limit\": %u,\n", regs.hb_limit);
+    printf("  \"shutdown_deadline\": %u", regs.sd_deadline);
+    if (g_regs_age >= 0) {
+        printf(",\n  \"age_ms\": %lld", (long long)g_regs_age);
+    }
+    printf("\n}\n");
 
     return 0;
 }
 
 int set_led_color(struct I2cDevice *dev, uint8_t r, uint8_t g, uint8_t b)
 {
+    if (!dev) {
+        static struct blob_buf msg;
+        blob_buf_init(&msg, 0);
+        blobmsg_add_u32(&msg, "r", r);
+        blobmsg_add_u32(&msg, "g", g);
+        blobmsg_add_u32(&msg, "b", b);
+        if (daemon_call("set_led", &msg, NULL, NULL) < 0) {
+            return -1;
+        }
+        printf("Set LED color to: R=0x%02x, G=0x%02x, B=0x%02x\n", r, g, b);
+        return 0;
+    }
+
     uint8_t data[4] = {g, r, b, 0x01};
-    int rc = i2c_writen_reg(dev, 8, data, 4);
+    int rc = i2c_writen_reg(dev, PMIC_REG_LED_G, data, sizeof(data));
     if (rc < 0) {
         fprintf(stderr, "Failed to write LED color\n");
         return -1;
@@ -131,7 +258,15 @@ int set_led_color(struct I2cDevice *dev, uint8_t r, uint8_t g, uint8_t b)
 
 int shutdown_device(struct I2cDevice *dev)
 {
-    int rc = i2c_write_reg(dev, 31, 0xff);
+    if (!dev) {
+        if (daemon_call("shutdown", NULL, NULL, NULL) < 0) {
+            return -1;
+        }
+        printf("Shutdown command sent.\n");
+        return 0;
+    }
+
+    int rc = i2c_write_reg(dev, PMIC_REG_OFF, PMIC_OFF_SHUTDOWN);
     if (rc < 0) {
         fprintf(stderr, "Failed to send shutdown command\n");
         return -1;
@@ -140,7 +275,63 @@ int shutdown_device(struct I2cDevice *dev)
     return 0;
 }
 
+int peek_status(int json)
+{
+    struct pmic_shm st;
+    const struct pmic_shm *shm = pmic_shm_open();
+
+    if (!shm) {
+        fprintf(stderr, "No PMIC status page at %s, is the daemon running?\n", PMIC_SHM_PATH);
+        return -1;
+    }
+    if (pmic_shm_read(shm, &st) < 0) {
+        fprintf(stderr, "PMIC status page kept changing\n");
+        pmic_shm_close(shm);
+        return -1;
+    }
+    pmic_shm_close(shm);
+
+    uint64_t age = mirror_real() - st.updated;
+    if (json) {
+        printf("{\n");
+        printf("  \"mv\": %u,\n", st.mv);
+        printf("  \"soc\": %u,\n", st.soc);
+        printf("  \"charge\": %u,\n", st.charge);
+        printf("  \"standby\": %u,\n", st.standby);
+        printf("  \"power\": %u,\n", st.power);
+        printf("  \"lte\": %u,\n", st.lte);
+        printf("  \"battery_low\": %u,\n", st.battery_low);
+        printf("  \"shutdown_request\": %u,\n", st.shutdown_request);
+        printf("  \"flags\": %u,\n", st.flags);
+        printf("  \"bus_failed\": %u,\n", st.bus_failed);
+        printf("  \"bus_recoveries\": %u,\n", st.bus_recoveries);
+        printf("  \"pid\": %u,\n", st.pid);
+        printf("  \"age_ms\": %llu\n", (unsigned long long)age);
+        printf("}\n");
+        return 0;
+    }
+
+    printf("Battery: %u mV (%u%%)%s\n", st.mv, st.soc, st.battery_low ? ", low" : "");
+    printf("Charger: %s%s\n", st.charge ? "charging" : "not charging", st.standby ? ", standby" : "");
+    printf("Power button: %s\n", st.power ? "pressed" : "released");
+    printf("LTE: %s\n", st.lte ? "up" : "down");
+    if (st.shutdown_request) {
+        printf("Shutdown requested, %u s deadline\n", st.regs.sd_deadline);
+    }
+    printf("I2C: %u failed, %u recoveries\n", st.bus_failed, st.bus_recoveries);
+    printf("(pmicctrl daemon %u, %llu ms old)\n", st.pid, (unsigned long long)age);
+    return 0;
+}
+
 /* Main function: command dispatch */
+/* Whether two bus names reach the same adapter, through either transport */
+static int same_bus(const char *a, const char *b)
+{
+    a += strncmp(a, "stub:", 5) == 0 ? 5 : 0;
+    b += strncmp(b, "stub:", 5) == 0 ? 5 : 0;
+    return strcmp(a, b) == 0;
+}
+
 int main(int argc, char *argv[])
 {
     int ret = 0;
@@ -155,22 +346,100 @@ int main(int argc, char *argv[])
         return EXIT_SUCCESS;
     }
 
-    /* Initialize the I2C device */
+    /* Served from the status page alone */
+    if (strcmp(argv[1], "peek") == 0) {
+        return peek_status(argc > 2 && strcmp(argv[2], "--json") == 0) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* A capture is printed without touching the configuration */
+    const char *replay = NULL;
+    unsigned long speed = 1;
+    if (strcmp(argv[1], "replay") == 0) {
+        int dump = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--dump") == 0) {
+                dump = 1;
+            } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+                speed = strtoul(argv[++i], NULL, 0);
+            } else if (!replay && argv[i][0] != '-') {
+                replay = argv[i];
+            } else {
+                replay = NULL;
+                break;
+            }
+        }
+        if (!replay || !speed) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (dump) {
+            return trace_dump(replay) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+
+    /* Bus, address and ADC scaling from /etc/config/pmic */
+    config_load();
+    char bus[sizeof(config_get()->bus)];
+    snprintf(bus, sizeof(bus), "%s", config_get()->bus);
+
+    /* Initialize the I2C device, unless a running daemon owns the bus */
     struct I2cDevice dev;
-    dev.filename = I2C_BUS;
-    dev.addr = PMIC_ADDR;
+    struct I2cDevice *pdev = NULL;
+    dev.filename = bus;
+    dev.addr = config_get()->addr;
+    dev.trace = NULL;
 
-    if (i2c_start(&dev) < 0) {
-        perror("i2c_start failed");
-        return EXIT_FAILURE;
+    /* The benchmark always talks to the bus, but never next to the daemon */
+    struct bench_opts bench;
+    if (strcmp(argv[1], "bench") == 0) {
+        if (bench_parse(argc - 2, argv + 2, &bench) < 0) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        /* --bus naming the daemon's own bus is still next to it */
+        if ((!bench.bus || same_bus(bench.bus, bus)) && pmicctrl_client_init("pmic") == 0) {
+            pmicctrl_client_cleanup();
+            fprintf(stderr, "pmicctrl daemon is using %s, stop it or pass another --bus\n", bus);
+            return EXIT_FAILURE;
+        }
+        if (bench.bus) {
+            snprintf(bus, sizeof(bus), "%s", bench.bus);
+        }
+        if (bench.addr >= 0) {
+            dev.addr = bench.addr;
+        }
+    }
+
+    /* A replay is the daemon on a played-back bus, one daemon at a time */
+    if (replay) {
+        if (pmicctrl_client_init("pmic") == 0) {
+            pmicctrl_client_cleanup();
+            fprintf(stderr, "pmicctrl daemon is running, stop it before a replay\n");
+            return EXIT_FAILURE;
+        }
+        snprintf(bus, sizeof(bus), "replay:%s,speed=%lu", replay, speed);
+    }
+
+    if (strcmp(argv[1], "daemon") == 0 || strcmp(argv[1], "bench") == 0 || replay ||
+        pmicctrl_client_init("pmic") != 0) {
+        if (i2c_start(&dev) < 0) {
+            perror("i2c_start failed");
+            return EXIT_FAILURE;
+        }
+        pdev = &dev;
+    }
+
+    /* Capture from the first probe to the last write, the daemon runs without one */
+    if (strcmp(argv[1], "daemon") == 0 && config_get()->trace[0] && trace_open(&dev, config_get()->trace) == 0) {
+        printf("Capturing bus traffic to %s\n", config_get()->trace);
     }
 
     /* Dispatch commands */
     if (strcmp(argv[1], "read") == 0) {
         if (argc > 2 && strcmp(argv[2], "--json") == 0)
-            ret = read_registers_json(&dev);
+            ret = read_registers_json(pdev);
         else
-            ret = read_registers_text(&dev);
+            ret = read_registers_text(pdev);
     } else if (strcmp(argv[1], "set-led") == 0) {
         if (argc != 5) {
             fprintf(stderr, "Error: set-led requires 3 arguments: R G B\n");
@@ -180,18 +449,25 @@ int main(int argc, char *argv[])
             uint8_t r = (uint8_t)strtol(argv[2], NULL, 0);
             uint8_t g = (uint8_t)strtol(argv[3], NULL, 0);
             uint8_t b = (uint8_t)strtol(argv[4], NULL, 0);
-            ret = set_led_color(&dev, r, g, b);
+            ret = set_led_color(pdev, r, g, b);
         }
     } else if (strcmp(argv[1], "shutdown") == 0) {
-        ret = shutdown_device(&dev);
-    } else if (strcmp(argv[1], "daemon") == 0) {
+        ret = shutdown_device(pdev);
+    } else if (strcmp(argv[1], "daemon") == 0 || replay) {
         ret = run_daemon(&dev);
+    } else if (strcmp(argv[1], "bench") == 0) {
+        ret = run_bench(&dev, &bench);
     } else {
         fprintf(stderr, "Unknown command: %s\n", argv[1]);
         print_usage(argv[0]);
         ret = EXIT_FAILURE;
     }
 
-    i2c_stop(&dev);
+    if (pdev) {
+        trace_close(pdev);
+        i2c_stop(pdev);
+    } else {
+        pmicctrl_client_cleanup();
+    }
     return ret;
 }
@@ -0,0 +1,294 @@
+/*
+ * poll.c - Multi-rate poll plan
+ *
+ * All groups share one timer. Deadlines are multiples of the group
+ * interval from a common epoch, so slower groups always coincide with a
+ * wakeup of faster ones. On every wakeup the registers of all due groups
+ * are merged into contiguous ranges and read in one combined transaction
+ * on the I2C worker; handlers run once the read has completed.
+ */
+
+#include <libubox/uloop.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "i2cq.h"
+#include "mirror.h"
+#include "poll.h"
+
+static struct poll_group *g_groups = NULL;
+static size_t g_count = 0;
+static uint64_t g_epoch = 0;
+static uint8_t g_order[32];     /* Group indexes by ascending priority */
+static uint32_t g_running = 0; /* Groups of the job in flight */
+static struct i2cq_job poll_job;
+static void (*g_cycle)(void) = NULL;
+
+/* Wakeups of the poll timer and of poll completions */
+static uint32_t g_wakeups = 0;
+static uint32_t g_minute_base = 0;
+static uint64_t g_minute_start = 0;
+static uint32_t g_wpm = 0;
+
+static void poll_cb(struct uloop_timeout *t);
+
+static struct uloop_timeout poll_timer = {
+    .cb = poll_cb,
+};
+
+/* Effective interval, a multiple of the nominal one so backoff stays aligned */
+static uint32_t poll_step(const struct poll_group *g)
+{
+    uint32_t step = g->interval;
+
+    for (uint8_t i = 0; i < g->fails && step * 2 <= POLL_BACKOFF_MAX; i++) {
+        step *= 2;
+    }
+    return step;
+}
+
+/* First multiple of the step from the epoch that lies after now */
+static uint64_t poll_align(const struct poll_group *g, uint64_t now)
+{
+    uint32_t step = poll_step(g);
+    return g_epoch + ((now - g_epoch) / step + 1) * step;
+}
+
+/* Timer jitter tolerated when pulling groups into a wakeup, ms */
+static uint32_t poll_slack(void)
+{
+    uint32_t min = UINT32_MAX;
+
+    for (size_t i = 0; i < g_count; i++) {
+        if (g_groups[i].interval && g_groups[i].interval < min) {
+            min = g_groups[i].interval;
+        }
+    }
+    return min == UINT32_MAX ? 0 : min / POLL_SLACK_DIV;
+}
+
+static int poll_is_due(const struct poll_group *g, uint64_t now, uint32_t slack)
+{
+    return g->interval && g->due <= now + slack;
+}
+
+/* Split the register mask into reads of the job, joining across small gaps */
+static void poll_ranges(uint32_t mask, struct i2cq_job *job)
+{
+    int first = -1;
+    int last = 0;
+
+    for (int reg = 0; reg < PMIC_REG_COUNT; reg++) {
+        if (!(mask & (1u << reg))) {
+            continue;
+        }
+
+        /* Start a new read unless joining is cheaper or out of batch slots */
+        if (first >= 0 && reg - last > POLL_MERGE_GAP + 1 && job->count + 1 < I2C_BATCH_MAX) {
+            i2cq_job_add(job, first, NULL, last - first + 1);
+            first = -1;
+        }
+        if (first < 0) {
+            first = reg;
+        }
+        last = reg;
+    }
+
+    if (first >= 0) {
+        i2cq_job_add(job, first, NULL, last - first + 1);
+    }
+}
+
+static void poll_arm(uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < g_count; i++) {
+        if (g_groups[i].interval && g_groups[i].due < next) {
+            next = g_groups[i].due;
+        }
+    }
+
+    if (next != UINT64_MAX) {
+        /* uloop runs in real time, the emulator may speed up mirror_now() */
+        uloop_timeout_set(&poll_timer, next > now ? (int)((next - now) / mirror_speed()) : 0);
+    }
+}
+
+static void poll_wakeup(uint64_t now)
+{
+    g_wakeups++;
+    if (now - g_minute_start >= 60000) {
+        g_wpm = g_wakeups - g_minute_base;
+        g_minute_base = g_wakeups;
+        g_minute_start = now;
+    }
+}
+
+/* Store the read of the @due groups and run their handlers */
+static void poll_complete(struct i2cq_job *job, uint32_t due)
+{
+    int ok = job->rc == 0;
+
+    /* Completions of a queued read come in through their own wakeup */
+    if (job->count) {
+        poll_wakeup(mirror_now());
+    }
+
+    if (ok) {
+        for (size_t i = 0; i < job->count; i++) {
+            mirror_store(job->xfers[i].reg, job->xfers[i].buf, job->xfers[i].len);
+        }
+    } else {
+        fprintf(stderr, "Failed to read PMIC registers: %s (%d)\n",
+                i2cq_err_name(i2cq_classify(job->rc)), job->rc);
+    }
+
+    /* Back off failing groups, recovered groups return to their own rate */
+    uint64_t now = mirror_now();
+    for (size_t i = 0; i < g_count; i++) {
+        struct poll_group *g = &g_groups[i];
+        if (!(due & (1u << i)) || !g->count) {
+            continue;
+        }
+
+        uint8_t fails = ok ? 0 : (g->fails < 16 ? g->fails + 1 : g->fails);
+        if (fails != g->fails) {
+            g->fails = fails;
+            g->due = poll_align(g, now);
+        }
+    }
+
+    /* Never run handlers on a failed read, register-less groups still run */
+    for (size_t n = 0; n < g_count; n++) {
+        size_t i = g_order[n];
+        struct poll_group *g = &g_groups[i];
+        if ((due & (1u << i)) && g->handler && (ok || !g->count)) {
+            g->handler();
+        }
+    }
+    if (g_cycle) {
+        g_cycle();
+    }
+
+    poll_arm(mirror_now());
+}
+
+static void poll_done(struct i2cq_job *job)
+{
+    uint32_t due = g_running;
+
+    g_running = 0;
+    poll_complete(job, due);
+}
+
+static void poll_cb(struct uloop_timeout *t)
+{
+    (void)t;
+    uint64_t now = mirror_now();
+    uint32_t due = 0;
+    uint32_t mask = 0;
+    uint8_t prio = I2CQ_PRIO_POLL;
+    uint32_t slack = poll_slack();
+    int rc;
+
+    poll_wakeup(now);
+    for (size_t i = 0; i < g_count; i++) {
+        struct poll_group *g = &g_groups[i];
+        if (!poll_is_due(g, now, slack)) {
+            continue;
+        }
+
+        /* Next deadline after this one, even if pulled in early */
+        g->due = poll_align(g, g->due > now ? g->due : now);
+
+        /* The previous read is still queued, skip a sample; register-less groups never wait */
+        if (g_running && g->count) {
+            continue;
+        }
+
+        due |= 1u << i;
+        if (g->count) {
+            mask |= (UINT32_MAX >> (32 - g->count)) << g->first;
+        }
+        if (g->priority == POLL_PRIO_URGENT) {
+            prio = I2CQ_PRIO_URGENT;
+        }
+    }
+
+    if (due && mask) {
+        memset(&poll_job, 0, sizeof(poll_job));
+        poll_job.prio = prio;
+        poll_job.done = poll_done;
+        poll_ranges(mask, &poll_job);
+        g_running = due;
+
+        /* Without the worker done() never comes, fail the read now so polling goes on */
+        if ((rc = i2cq_submit(&poll_job)) < 0) {
+            poll_job.rc = rc;
+            poll_done(&poll_job);
+        }
+    } else if (due) {
+        struct i2cq_job none = {.rc = 0};
+        poll_complete(&none, due);
+    }
+
+    poll_arm(mirror_now());
+}
+
+void poll_start(struct poll_group *groups, size_t n)
+{
+    g_groups = groups;
+    g_count = n < 32 ? n : 32;
+    g_epoch = mirror_now();
+    g_minute_start = g_epoch;
+
+    /* Insertion sort, handlers of one wakeup then run by priority */
+    for (size_t i = 0; i < g_count; i++) {
+        size_t j = i;
+        while (j > 0 && groups[g_order[j - 1]].priority > groups[i].priority) {
+            g_order[j] = g_order[j - 1];
+            j--;
+        }
+        g_order[j] = i;
+    }
+
+    poll_reschedule();
+}
+
+void poll_on_cycle(void (*cb)(void))
+{
+    g_cycle = cb;
+}
+
+void poll_reschedule(void)
+{
+    uint64_t now = mirror_now();
+
+    for (size_t i = 0; i < g_count; i++) {
+        if (g_groups[i].interval) {
+            g_groups[i].due = poll_align(&g_groups[i], now);
+        }
+    }
+    poll_arm(now);
+}
+
+void poll_set_interval(struct poll_group *group, uint32_t interval)
+{
+    uint64_t now = mirror_now();
+
+    if (group->interval == interval) {
+        return;
+    }
+
+    group->interval = interval;
+    if (interval) {
+        group->due = poll_align(group, now);
+    }
+    poll_arm(now);
+}
+
+uint32_t poll_wakeups_per_minute(void)
+{
+    return g_wpm;
+}
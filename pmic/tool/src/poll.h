@@ -0,0 +1,54 @@
+#ifndef __POLL_H
+#define __POLL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Gap of unused registers still read through to join two ranges */
+#define POLL_MERGE_GAP 2
+
+/* Upper bound of the retry interval of a failing group, ms */
+#define POLL_BACKOFF_MAX 10000
+
+/* Groups of this priority are read ahead of all other bus traffic */
+#define POLL_PRIO_URGENT 0
+
+/* Groups due within the shortest interval / POLL_SLACK_DIV join the current wakeup */
+#define POLL_SLACK_DIV 8
+
+/*
+ * A register group of the poll plan. Groups that fall due in the same
+ * wakeup are read together in the fewest contiguous bursts, then their
+ * handlers run by ascending priority. A group without registers only runs
+ * its handler, a group with a zero interval is disabled. A group whose
+ * read fails is retried with exponential backoff up to POLL_BACKOFF_MAX.
+ */
+struct poll_group
+{
+    const char *name;
+    uint8_t first;          /* First register */
+    uint8_t count;          /* Number of registers, 0 - handler only */
+    uint32_t interval;      /* ms */
+    uint8_t priority;       /* Lower runs first */
+    void (*handler)(void);  /* Called after a successful read, may be NULL */
+
+    uint64_t due;           /* Next deadline, mirror_now() ms */
+    uint8_t fails;          /* Failed reads in a row, the interval doubles per failure */
+};
+
+/* Start polling through the I2C worker, the plan must outlive the daemon loop */
+void poll_start(struct poll_group *groups, size_t n);
+
+/* Called once per wakeup after the handlers of all due groups ran */
+void poll_on_cycle(void (*cb)(void));
+
+/* Re-arm after a group interval changed */
+void poll_reschedule(void);
+
+/* Change the rate of one group, its phase stays aligned to the epoch */
+void poll_set_interval(struct poll_group *group, uint32_t interval);
+
+/* Timer and completion wakeups during the last full minute */
+uint32_t poll_wakeups_per_minute(void);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * replay.c - Bus transport that plays back a capture
+ *
+ * Turns a trace taken on a unit in the field into a reproducible run of
+ * the daemon on any machine: the same register values, bus errors and
+ * latencies, at the same points in time or faster.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mirror.h"
+#include "replay.h"
+#include "trace.h"
+
+static uint8_t *g_buf;
+static size_t g_size;
+static size_t g_pos;         /* Next record */
+static uint64_t g_t;         /* Capture us of the last transaction played */
+static uint64_t g_start;     /* mirror_now() the replay started at */
+static uint64_t g_offset;    /* Capture us of the first transaction */
+static uint32_t g_played;
+static uint32_t g_dur;       /* us the last transaction played took */
+static int g_err;            /* errno of the last failed transaction */
+static uint32_t g_failed;    /* Failed transactions not passed on yet, one per transfer */
+static int g_ended;          /* All records played */
+static int g_done;           /* End reported, every transfer fails */
+
+/* One past the register map and a whole transfer, reg + len never leaves it */
+static uint8_t g_image[256 + I2C_XFER_MAX];
+
+/* Play the capture up to @now us */
+static void replay_play(uint64_t now)
+{
+    const struct trace_record *rec;
+    const uint8_t *data;
+    size_t pos = g_pos;
+
+    while (trace_next(g_buf, g_size, &pos, &rec, &data) == 0) {
+        if (!(rec->flags & TRACE_BATCH)) {
+            if (g_t + rec->delta > now) {
+                return;
+            }
+            g_t += rec->delta;
+            g_dur = rec->dur;
+            g_played++;
+            if (rec->err) {
+                g_err = rec->err;
+                g_failed++;
+            }
+        }
+
+        /* Writes were the daemon's own, the replayed daemon makes its own */
+        if (!rec->err && !(rec->flags & TRACE_WRITE)) {
+            memcpy(&g_image[rec->reg], data, rec->len);
+        }
+        g_pos = pos;
+    }
+    g_ended = 1;
+}
+
+static int replay_start(struct I2cDevice *dev, const char *bus)
+{
+    const struct trace_record *rec;
+    const uint8_t *data;
+    char path[256];
+    char *opt;
+    unsigned long speed = 1;
+    size_t pos = 0;
+
+    if (snprintf(path, sizeof(path), "%s", bus) >= (int)sizeof(path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((opt = strchr(path, ','))) {
+        char *end;
+
+        *opt++ = '\0';
+        if (strncmp(opt, "speed=", 6) != 0 || !(speed = strtoul(opt + 6, &end, 10)) || *end || speed > 100000) {
+            fprintf(stderr, "replay: bad option '%s', expected speed=N\n", opt);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    dev->fd = -1;
+    if (g_buf) {
+        return 0;
+    }
+
+    if (!(g_buf = trace_load(path, &g_size))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Start at the first transaction, the daemon probes right away */
+    if (trace_next(g_buf, g_size, &pos, &rec, &data) == 0) {
+        g_offset = rec->delta;
+    }
+
+    mirror_set_speed(speed);
+    g_start = mirror_now();
+    fprintf(stderr, "replay: %s, %zu bytes, speed %lu\n", path, g_size, speed);
+    return 0;
+}
+
+static int replay_xfer(struct I2cDevice *dev, struct i2c_xfer *xfers, size_t count)
+{
+    uint32_t hold;
+
+    (void)dev;
+
+    if (g_done) {
+        return -ENXIO;
+    }
+    replay_play((mirror_now() - g_start) * 1000 + g_offset);
+    if (g_ended) {
+        fprintf(stderr, "replay: end of capture after %u transactions, %.1f s\n", g_played, (double)g_t / 1e6);
+        g_done = 1;
+        kill(getpid(), SIGTERM);
+        return -ENXIO;
+    }
+
+    hold = g_dur > REPLAY_LATENCY_MAX ? REPLAY_LATENCY_MAX : g_dur;
+    if (hold / mirror_speed()) {
+        usleep(hold / mirror_speed());
+    }
+
+    if (g_failed) {
+        g_failed--;
+        return -g_err;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (xfers[i].len == 0 || xfers[i].len > I2C_XFER_MAX) {
+            return -EINVAL;
+        }
+        if (xfers[i].write) {
+            memcpy(&g_image[xfers[i].reg], xfers[i].buf, xfers[i].len);
+        } else {
+            memcpy(xfers[i].buf, &g_image[xfers[i].reg], xfers[i].len);
+        }
+    }
+    return 0;
+}
+
+static void replay_stop(struct I2cDevice *dev)
+{
+    (void)dev;
+}
+
+const struct i2c_ops replay_ops = {
+    .prefix = "replay:",
+    .simulated = 1,
+    .start = replay_start,
+    .xfer = replay_xfer,
+    .stop = replay_stop,
+};
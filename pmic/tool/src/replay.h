@@ -0,0 +1,24 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include "i2c.h"
+
+/* Longest recorded latency a replayed transaction is held for, us */
+#define REPLAY_LATENCY_MAX 1000000
+
+/*
+ * Bus that plays back a trace_open() capture, selected with a bus name of
+ *
+ *   replay:FILE[,speed=N]
+ *
+ * The capture is played on the daemon clock, sped up N times: reads see
+ * the registers as last read in the capture, writes land in that image
+ * until the capture reads them again. Every failed capture transaction
+ * fails the next transfer with its errno, and transfers take as long as
+ * the last capture transaction did. At the end of the capture the process
+ * gets SIGTERM. Like the emulator it is simulated, a replayed shutdown
+ * request or long press does not power off the machine it runs on.
+ */
+extern const struct i2c_ops replay_ops;
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * rules.c - PMIC event rules
+ *
+ * Maps daemon events to actions in-process, replacing the `ubus listen`
+ * shell pipeline. Rules come from /etc/config/pmic:
+ *
+ *   config rule
+ *       option event    'charge'    # start|power|charge|standby|lte|poweroff|runtime
+ *       option value    '1'         # optional, event value to match
+ *       option below    '15'        # optional, match values under it
+ *       option charging '1'         # optional, charger state to match
+ *       option color    '0 48 16'   # optional, LED "R G B"
+ *       option blink    '500'       # optional, blink period in ms
+ *       option action   'poweroff'  # optional, poweroff|exec
+ *       option exec     '/usr/bin/script'
+ *
+ * The first rule matching an event wins. poweroff signals procd directly,
+ * only exec actions fork; on the emulator or a replay both are only
+ * logged. A rule with `below` runs once when the value drops under it
+ * and again only after the value went back up, so a runtime rule acts on
+ * the predicted minutes left, not on every sample.
+ */
+
+#include <libubox/uloop.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uci.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "mirror.h"
+#include "rules.h"
+
+extern char **environ;
+
+enum rule_action
+{
+    RULE_ACT_NONE,
+    RULE_ACT_POWEROFF,
+    RULE_ACT_EXEC,
+};
+
+struct rule
+{
+    uint8_t event;
+    int8_t charging;   /* RULE_ANY, 0 or 1 */
+    int16_t value;     /* RULE_ANY or the event value */
+    int32_t below;     /* RULE_ANY or the bound values must stay under */
+    uint8_t latched;   /* Ran since the value dropped under below */
+    uint8_t has_color;
+    uint8_t r, g, b;
+    uint16_t blink;    /* ms, 0 - steady */
+    uint8_t action;
+    char *exec;
+};
+
+static const char *const event_names[__RULE_EV_MAX] = {
+    [RULE_EV_START] = "start",
+    [RULE_EV_POWER] = "power",
+    [RULE_EV_CHARGE] = "charge",
+    [RULE_EV_STANDBY] = "standby",
+    [RULE_EV_LTE] = "lte",
+    [RULE_EV_POWEROFF] = "poweroff",
+    [RULE_EV_RUNTIME] = "runtime",
+};
+
+static struct rule g_rules[RULES_MAX];
+static int g_count = 0;
+
+/* --- LED Animation --- */
+static const struct rule *blink_rule = NULL;
+static int blink_on = 0;
+
+static void blink_cb(struct uloop_timeout *t)
+{
+    blink_on = !blink_on;
+    if (blink_on) {
+        pmic_led_set(blink_rule->r, blink_rule->g, blink_rule->b);
+    } else {
+        pmic_led_set(0, 0, 0);
+    }
+    uloop_timeout_set(t, blink_rule->blink / 2);
+}
+
+static struct uloop_timeout blink_timer = {
+    .cb = blink_cb,
+};
+
+static void rule_led(const struct rule *rule)
+{
+    uloop_timeout_cancel(&blink_timer);
+    pmic_led_set(rule->r, rule->g, rule->b);
+
+    if (rule->blink) {
+        blink_rule = rule;
+        blink_on = 1;
+        uloop_timeout_set(&blink_timer, rule->blink / 2);
+    }
+}
+
+/* --- Actions --- */
+static void exec_done(struct uloop_process *p, int ret)
+{
+    (void)ret;
+    free(p);
+}
+
+/*
+ * The I2C worker and telemetry run threads, so the child may only call
+ * async-signal-safe functions: arguments and environment are built first.
+ */
+static void rule_exec(const struct rule *rule, enum rule_event event, int value)
+{
+    struct uloop_process *p = calloc(1, sizeof(*p));
+    char val[16], env_event[32], env_value[32];
+    size_t n = 0;
+    char **envp;
+
+    if (!p) {
+        return;
+    }
+
+    snprintf(val, sizeof(val), "%d", value);
+    snprintf(env_event, sizeof(env_event), "PMIC_EVENT=%s", event_names[event]);
+    snprintf(env_value, sizeof(env_value), "PMIC_VALUE=%s", val);
+    char *const argv[] = {rule->exec, (char *)event_names[event], val, NULL};
+
+    while (environ[n]) {
+        n++;
+    }
+    if (!(envp = calloc(n + 3, sizeof(*envp)))) {
+        free(p);
+        return;
+    }
+    n = 0;
+    for (char **e = environ; *e; e++) {
+        if (strncmp(*e, "PMIC_EVENT=", 11) != 0 && strncmp(*e, "PMIC_VALUE=", 11) != 0) {
+            envp[n++] = *e;
+        }
+    }
+    envp[n++] = env_event;
+    envp[n++] = env_value;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execve(rule->exec, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    if (pid < 0) {
+        perror("rules: fork");
+        free(p);
+        return;
+    }
+
+    p->pid = pid;
+    p->cb = exec_done;
+    uloop_process_add(p);
+}
+
+static void rule_run(const struct rule *rule, enum rule_event event, int value)
+{
+    if (rule->has_color) {
+        rule_led(rule);
+    }
+
+    /* The emulated battery must not power off the router it runs on */
+    if (rule->action != RULE_ACT_NONE && pmic_simulated()) {
+        printf("Rule %s=%d: %s skipped on a simulated PMIC\n", event_names[event], value,
+               rule->action == RULE_ACT_POWEROFF ? "poweroff" : rule->exec);
+        return;
+    }
+
+    switch (rule->action) {
+    case RULE_ACT_POWEROFF:
+        /* procd treats SIGUSR2 as poweroff, runs the stop scripts and syncs */
+        printf("Rule %s=%d: poweroff\n", event_names[event], value);
+        if (kill(1, SIGUSR2) < 0) {
+            perror("rules: poweroff");
+        }
+        break;
+    case RULE_ACT_EXEC:
+        rule_exec(rule, event, value);
+        break;
+    default:
+        break;
+    }
+}
+
+void rules_fire(enum rule_event event, int value)
+{
+    /* CHRG pin is active low */
+    int charging = !mirror_regs()->in_state.charge;
+
+    for (int i = 0; i < g_count; i++) {
+        struct rule *rule = &g_rules[i];
+        if (rule->event != event ||
+            (rule->value != RULE_ANY && rule->value != value) ||
+            (rule->charging != RULE_ANY && rule->charging != charging)) {
+            continue;
+        }
+
+        if (rule->below != RULE_ANY) {
+            if (value >= rule->below) {
+                rule->latched = 0;
+                continue;
+            }
+            if (rule->latched) {
+                return;
+            }
+            rule->latched = 1;
+        }
+
+        rule_run(rule, event, value);
+        return;
+    }
+}
+
+/* --- Configuration --- */
+static int rule_parse(struct uci_context *ctx, struct uci_section *s, struct rule *rule)
+{
+    const char *opt;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->value = RULE_ANY;
+    rule->below = RULE_ANY;
+    rule->charging = RULE_ANY;
+
+    opt = uci_lookup_option_string(ctx, s, "event");
+    if (!opt) {
+        return -1;
+    }
+    for (rule->event = 0; rule->event < __RULE_EV_MAX; rule->event++) {
+        if (strcmp(opt, event_names[rule->event]) == 0) {
+            break;
+        }
+    }
+    if (rule->event == __RULE_EV_MAX) {
+        fprintf(stderr, "rules: unknown event '%s'\n", opt);
+        return -1;
+    }
+
+    if ((opt = uci_lookup_option_string(ctx, s, "value"))) {
+        rule->value = atoi(opt);
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "below"))) {
+        rule->below = atoi(opt);
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "charging"))) {
+        rule->charging = atoi(opt) ? 1 : 0;
+    }
+
+    if ((opt = uci_lookup_option_string(ctx, s, "color"))) {
+        unsigned int r, g, b;
+        if (sscanf(opt, "%u %u %u", &r, &g, &b) != 3 || r > 255 || g > 255 || b > 255) {
+            fprintf(stderr, "rules: bad color '%s'\n", opt);
+            return -1;
+        }
+        rule->has_color = 1;
+        rule->r = r;
+        rule->g = g;
+        rule->b = b;
+    }
+    if ((opt = uci_lookup_option_string(ctx, s, "blink"))) {
+        int blink = atoi(opt);
+        rule->blink = blink > 0 && blink <= 60000 ? blink : 0;
+    }
+
+    if ((opt = uci_lookup_option_string(ctx, s, "action"))) {
+        if (strcmp(opt, "poweroff") == 0) {
+            rule->action = RULE_ACT_POWEROFF;
+        } else if (strcmp(opt, "exec") == 0) {
+            const char *cmd = uci_lookup_option_string(ctx, s, "exec");
+            if (!cmd || !(rule->exec = strdup(cmd))) {
+                fprintf(stderr, "rules: exec action without exec option\n");
+                return -1;
+            }
+            rule->action = RULE_ACT_EXEC;
+        } else {
+            fprintf(stderr, "rules: unknown action '%s'\n", opt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rules_load(void)
+{
+    struct uci_context *ctx = uci_alloc_context();
+    struct uci_package *pkg = NULL;
+    struct uci_element *e;
+
+    rules_free();
+    if (!ctx) {
+        return 0;
+    }
+
+    if (uci_load(ctx, "pmic", &pkg) != 0) {
+        fprintf(stderr, "rules: /etc/config/pmic not loaded, no rules\n");
+        uci_free_context(ctx);
+        return 0;
+    }
+
+    uci_foreach_element(&pkg->sections, e) {
+        struct uci_section *s = uci_to_section(e);
+        if (strcmp(s->type, "rule") != 0) {
+            continue;
+        }
+        if (g_count == RULES_MAX) {
+            fprintf(stderr, "rules: more than %d rules, ignoring the rest\n", RULES_MAX);
+            break;
+        }
+        if (rule_parse(ctx, s, &g_rules[g_count]) == 0) {
+            g_count++;
+        } else {
+            free(g_rules[g_count].exec);
+        }
+    }
+
+    uci_unload(ctx, pkg);
+    uci_free_context(ctx);
+    printf("Loaded %d PMIC rules\n", g_count);
+    return g_count;
+}
+
+void rules_free(void)
+{
+    uloop_timeout_cancel(&blink_timer);
+    blink_rule = NULL;
+    for (int i = 0; i < g_count; i++) {
+        free(g_rules[i].exec);
+    }
+    memset(g_rules, 0, sizeof(g_rules));
+    g_count = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __RULES_H
+#define __RULES_H
+
+#include <stdint.h>
+
+/* Events the rules can match on, names as in /etc/config/pmic */
+enum rule_event
+{
+    RULE_EV_START,       /* Daemon started */
+    RULE_EV_POWER,       /* Power button, 1 - pressed */
+    RULE_EV_CHARGE,      /* Charger, 1 - charging */
+    RULE_EV_STANDBY,     /* TP4056 standby pin */
+    RULE_EV_LTE,         /* First LTE link up */
+    RULE_EV_POWEROFF,    /* EVENT_POWEROFF_*, 1 - long button press, 2 - PMIC shutdown request */
+    RULE_EV_RUNTIME,     /* Predicted min to empty, confident estimates only */
+    __RULE_EV_MAX,
+};
+
+/* Match any value / any charger state */
+#define RULE_ANY -1
+
+/* Rules table size, further sections are ignored */
+#define RULES_MAX 32
+
+/* Load the `config rule` sections of /etc/config/pmic, returns the rule count */
+int rules_load(void);
+
+/* Run the first rule matching the event, no-op if none does */
+void rules_fire(enum rule_event event, int value);
+
+/* Drop all rules and stop a running animation */
+void rules_free(void);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * shm.c - Writer side of the /dev/shm/pmic status page
+ *
+ * Only the uloop thread writes, so the sequence lock needs no writer lock.
+ * The page is built under a temporary name and renamed into place, a
+ * reader never maps a half-initialized header.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "i2cq.h"
+#include "mirror.h"
+#include "shm.h"
+
+static struct pmic_shm *g_shm = NULL;
+
+int shm_start(void)
+{
+    const char *tmp = PMIC_SHM_PATH ".tmp";
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        perror("Failed to create " PMIC_SHM_PATH);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct pmic_shm)) < 0) {
+        perror("Failed to size " PMIC_SHM_PATH);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    void *page = mmap(NULL, sizeof(struct pmic_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("Failed to map " PMIC_SHM_PATH);
+        unlink(tmp);
+        return -1;
+    }
+
+    g_shm = page;
+    g_shm->magic = PMIC_SHM_MAGIC;
+    g_shm->version = PMIC_SHM_VERSION;
+    g_shm->size = sizeof(struct pmic_shm);
+    g_shm->pid = getpid();
+
+    if (rename(tmp, PMIC_SHM_PATH) < 0) {
+        perror("Failed to publish " PMIC_SHM_PATH);
+        munmap(g_shm, sizeof(struct pmic_shm));
+        g_shm = NULL;
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void shm_publish(void)
+{
+    const struct pmic_regs *regs = mirror_regs();
+    struct i2cq_health health;
+
+    if (!g_shm) {
+        return;
+    }
+    i2cq_health_get(&health);
+
+    /* Odd sequence, readers retry until the update is complete */
+    __atomic_store_n(&g_shm->seq, g_shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    g_shm->updated = mirror_real();
+    g_shm->mv = events_mv(regs->adc);
+    g_shm->soc = events_soc(g_shm->mv);
+    g_shm->charge = !regs->in_state.charge;
+    g_shm->standby = !regs->in_state.stdby;
+    g_shm->power = !regs->in_state.pwr;
+    g_shm->lte = regs->in_state.lte;
+    g_shm->battery_low = regs->in_state.bat_low;
+    g_shm->shutdown_request = regs->in_state.sd_req;
+    g_shm->flags = regs->in_state.raw;
+    g_shm->bus_failed = health.failed;
+    g_shm->bus_recoveries = health.recoveries;
+    g_shm->regs = *regs;
+
+    __atomic_store_n(&g_shm->seq, g_shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+void shm_stop(void)
+{
+    if (g_shm) {
+        munmap(g_shm, sizeof(struct pmic_shm));
+        unlink(PMIC_SHM_PATH);
+        g_shm = NULL;
+    }
+}
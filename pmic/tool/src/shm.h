@@ -0,0 +1,15 @@
+#ifndef __SHM_H
+#define __SHM_H
+
+#include "pmic_shm.h"
+
+/* Create the status page, replacing a stale one atomically */
+int shm_start(void);
+
+/* Publish the mirror and the bus health to the status page */
+void shm_publish(void);
+
+/* Unmap and remove the status page */
+void shm_stop(void);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * telemetry.c - Binary telemetry stream over a Unix socket
+ *
+ * Each client owns a bounded queue of fixed-size records. Sends never
+ * block: whatever the socket does not take waits in the queue until the
+ * client is writable again, and a sample that finds the queue full is
+ * dropped and counted. A stuck client costs its queue and nothing else.
+ */
+
+#define _GNU_SOURCE /* accept4 */
+#include <errno.h>
+#include <libubox/uloop.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "i2cq.h"
+#include "mirror.h"
+#include "telemetry.h"
+
+#define TELEMETRY_RECORD_MAX (sizeof(struct pmic_telemetry_hdr) + __PMIC_TELEMETRY_MAX * sizeof(uint32_t))
+
+struct telemetry_client
+{
+    struct uloop_fd fd;
+    uint32_t interval; /* ms, 0 - paused */
+    uint32_t fields;
+    uint64_t next;     /* mirror_now() of the next sample */
+    uint32_t seq;
+    uint32_t dropped;
+    uint8_t head;      /* Oldest queued record */
+    uint8_t count;     /* Queued records */
+    uint8_t len;       /* Record size of the current field set */
+    uint8_t queue[TELEMETRY_QUEUE][TELEMETRY_RECORD_MAX];
+};
+
+static struct uloop_fd g_listen = {.fd = -1};
+static struct telemetry_client g_clients[TELEMETRY_CLIENTS_MAX];
+static struct poll_group *g_group = NULL;
+
+static void telemetry_client_close(struct telemetry_client *c);
+
+/* Sample the fastest client asks for, the poll group is off without clients */
+static void telemetry_rate(void)
+{
+    uint32_t min = 0;
+
+    for (int i = 0; i < TELEMETRY_CLIENTS_MAX; i++) {
+        struct telemetry_client *c = &g_clients[i];
+        if (c->fd.registered && c->interval && (!min || c->interval < min)) {
+            min = c->interval;
+        }
+    }
+    poll_set_interval(g_group, min);
+}
+
+/* Send queued records until the socket is full, then wait for ULOOP_WRITE */
+static void telemetry_client_flush(struct telemetry_client *c)
+{
+    while (c->count) {
+        ssize_t n = send(c->fd.fd, c->queue[c->head], c->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            telemetry_client_close(c);
+            return;
+        }
+        c->head = (c->head + 1) % TELEMETRY_QUEUE;
+        c->count--;
+    }
+
+    uloop_fd_add(&c->fd, ULOOP_READ | (c->count ? ULOOP_WRITE : 0));
+}
+
+static uint8_t telemetry_record_len(uint32_t fields)
+{
+    return sizeof(struct pmic_telemetry_hdr) + __builtin_popcount(fields) * sizeof(uint32_t);
+}
+
+static void telemetry_client_request(struct telemetry_client *c, const struct pmic_telemetry_req *req)
+{
+    c->interval = req->interval < PMIC_TELEMETRY_MIN_INTERVAL ? PMIC_TELEMETRY_MIN_INTERVAL : req->interval;
+    c->fields = req->fields & ((1u << __PMIC_TELEMETRY_MAX) - 1);
+    if (!c->fields) {
+        c->interval = 0;
+    }
+
+    /* Queued records have the old size, the new field set starts clean */
+    c->dropped += c->count;
+    c->count = 0;
+    c->len = telemetry_record_len(c->fields);
+    c->next = mirror_now();
+    telemetry_rate();
+}
+
+static void telemetry_client_cb(struct uloop_fd *fd, unsigned int events)
+{
+    struct telemetry_client *c = container_of(fd, struct telemetry_client, fd);
+
+    if (events & ULOOP_WRITE) {
+        telemetry_client_flush(c);
+        if (!c->fd.registered) {
+            return;
+        }
+    }
+    if (!(events & ULOOP_READ)) {
+        return;
+    }
+
+    for (;;) {
+        struct pmic_telemetry_req req;
+        ssize_t n = recv(fd->fd, &req, sizeof(req), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            telemetry_client_close(c);
+            return;
+        }
+        if (n == sizeof(req) && req.magic == PMIC_TELEMETRY_MAGIC) {
+            telemetry_client_request(c, &req);
+        }
+    }
+}
+
+static void telemetry_client_close(struct telemetry_client *c)
+{
+    uloop_fd_delete(&c->fd);
+    close(c->fd.fd);
+    memset(c, 0, sizeof(*c));
+    telemetry_rate();
+}
+
+static void telemetry_accept_cb(struct uloop_fd *fd, unsigned int events)
+{
+    (void)events;
+
+    for (;;) {
+        int cfd = accept4(fd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        struct telemetry_client *c = NULL;
+        for (int i = 0; i < TELEMETRY_CLIENTS_MAX; i++) {
+            if (!g_clients[i].fd.registered) {
+                c = &g_clients[i];
+                break;
+            }
+        }
+        if (!c) {
+            fprintf(stderr, "Telemetry client refused, %d connected\n", TELEMETRY_CLIENTS_MAX);
+            close(cfd);
+            continue;
+        }
+
+        memset(c, 0, sizeof(*c));
+        c->fd.fd = cfd;
+        c->fd.cb = telemetry_client_cb;
+        uloop_fd_add(&c->fd, ULOOP_READ);
+    }
+}
+
+int telemetry_start(struct poll_group *group)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    g_group = group;
+    strncpy(addr.sun_path, PMIC_TELEMETRY_PATH, sizeof(addr.sun_path) - 1);
+    unlink(PMIC_TELEMETRY_PATH);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create the telemetry socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, TELEMETRY_CLIENTS_MAX) < 0) {
+        perror("Failed to listen on " PMIC_TELEMETRY_PATH);
+        close(fd);
+        return -1;
+    }
+
+    g_listen.fd = fd;
+    g_listen.cb = telemetry_accept_cb;
+    uloop_fd_add(&g_listen, ULOOP_READ);
+    return 0;
+}
+
+void telemetry_sample(void)
+{
+    const struct pmic_regs *regs = mirror_regs();
+    uint64_t now = mirror_now();
+    uint32_t values[__PMIC_TELEMETRY_MAX];
+    struct i2cq_health health;
+
+    i2cq_health_get(&health);
+    values[PMIC_TELEMETRY_TIME] = (uint32_t)mirror_real();
+    values[PMIC_TELEMETRY_MV] = events_mv(regs->adc);
+    values[PMIC_TELEMETRY_ADC] = regs->adc;
+    values[PMIC_TELEMETRY_SOC] = events_soc(values[PMIC_TELEMETRY_MV]);
+    values[PMIC_TELEMETRY_FLAGS] = regs->in_state.raw;
+    values[PMIC_TELEMETRY_PMIC_TM] = regs->tm;
+    values[PMIC_TELEMETRY_LED] = (uint32_t)regs->led_r << 16 | (uint32_t)regs->led_g << 8 | regs->led_b;
+    values[PMIC_TELEMETRY_AGE] = mirror_age(PMIC_REG_ADC);
+    values[PMIC_TELEMETRY_BUS_FAILED] = health.failed;
+    values[PMIC_TELEMETRY_BUS_RECOVERIES] = health.recoveries;
+
+    /* Same slack as the poll plan, a sample may come in a little early */
+    for (int i = 0; i < TELEMETRY_CLIENTS_MAX; i++) {
+        struct telemetry_client *c = &g_clients[i];
+        if (!c->fd.registered || !c->interval || now + c->interval / POLL_SLACK_DIV < c->next) {
+            continue;
+        }
+
+        c->next = (c->next + c->interval > now) ? c->next + c->interval : now + c->interval;
+        c->seq++;
+        if (c->count == TELEMETRY_QUEUE) {
+            c->dropped++;
+            continue;
+        }
+
+        uint8_t *rec = c->queue[(c->head + c->count) % TELEMETRY_QUEUE];
+        struct pmic_telemetry_hdr hdr = {.seq = c->seq, .dropped = c->dropped};
+        size_t off = sizeof(hdr);
+        memcpy(rec, &hdr, sizeof(hdr));
+        for (int f = 0; f < __PMIC_TELEMETRY_MAX; f++) {
+            if (c->fields & (1u << f)) {
+                memcpy(rec + off, &values[f], sizeof(uint32_t));
+                off += sizeof(uint32_t);
+            }
+        }
+        c->count++;
+        telemetry_client_flush(c);
+    }
+}
+
+void telemetry_stop(void)
+{
+    for (int i = 0; i < TELEMETRY_CLIENTS_MAX; i++) {
+        if (g_clients[i].fd.registered) {
+            uloop_fd_delete(&g_clients[i].fd);
+            close(g_clients[i].fd.fd);
+        }
+    }
+    memset(g_clients, 0, sizeof(g_clients));
+
+    if (g_listen.fd >= 0) {
+        uloop_fd_delete(&g_listen);
+        close(g_listen.fd);
+        unlink(PMIC_TELEMETRY_PATH);
+        g_listen.fd = -1;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include "pmic_telemetry.h"
+#include "poll.h"
+
+/* Concurrent stream clients, further connections are refused */
+#define TELEMETRY_CLIENTS_MAX 4
+
+/* Samples queued per client before new ones are dropped */
+#define TELEMETRY_QUEUE 32
+
+/*
+ * Listen on PMIC_TELEMETRY_PATH. @group is the poll group that reads the
+ * sampled registers, its interval follows the fastest client and it is
+ * disabled while nobody is connected; its handler must call
+ * telemetry_sample().
+ */
+int telemetry_start(struct poll_group *group);
+
+/* Send a sample to every client that is due one */
+void telemetry_sample(void);
+
+/* Close all clients and the listening socket */
+void telemetry_stop(void);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * trace.c - Binary capture of PMIC bus traffic
+ *
+ * The I2C layer hands every transaction to trace_write(), which appends a
+ * 12 byte trace_record per transfer plus its data to a buffered file.
+ * Idle (1 s state poll and heartbeat, 5 s battery and register groups)
+ * that is about 40 bytes/s, close to a day in TRACE_MAX_SIZE. At the
+ * 100 ms status poll the state reads alone are 130 bytes/s, about 155 in
+ * all, so a busy capture stops after some 7 hours; telemetry clients
+ * add 15 bytes per sample. The replay transport and `pmicctrl replay
+ * --dump` read it back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "trace.h"
+
+struct trace
+{
+    FILE *f;
+    char path[64];
+    size_t size;      /* Bytes written so far */
+    uint64_t last;    /* trace_clock() of the previous transaction */
+    uint64_t flushed; /* trace_clock() of the last flush */
+    int full;
+};
+
+uint64_t trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_open(struct I2cDevice *dev, const char *path)
+{
+    struct trace *trace = calloc(1, sizeof(*trace));
+    struct trace_header hdr = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .addr = dev->addr,
+    };
+    struct timeval tv;
+
+    if (!trace) {
+        return -1;
+    }
+    if (!(trace->f = fopen(path, "w"))) {
+        perror(path);
+        free(trace);
+        return -1;
+    }
+    snprintf(trace->path, sizeof(trace->path), "%s", path);
+
+    gettimeofday(&tv, NULL);
+    hdr.start = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    if (fwrite(&hdr, sizeof(hdr), 1, trace->f) != 1) {
+        perror(path);
+        fclose(trace->f);
+        free(trace);
+        return -1;
+    }
+
+    trace->size = sizeof(hdr);
+    trace->last = trace->flushed = trace_clock();
+    dev->trace = trace;
+    return 0;
+}
+
+void trace_write(struct trace *trace, const struct i2c_xfer *xfers, size_t count, int rc, uint64_t start)
+{
+    uint64_t now = trace_clock();
+    uint64_t delta = start - trace->last;
+    size_t size = 0;
+
+    if (trace->full) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size += sizeof(struct trace_record) + xfers[i].len;
+    }
+    if (trace->size + size > TRACE_MAX_SIZE) {
+        fprintf(stderr, "trace: %s reached %u bytes, capture stopped\n", trace->path, TRACE_MAX_SIZE);
+        fflush(trace->f);
+        trace->full = 1;
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct trace_record rec = {
+            .delta = i ? 0 : delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta,
+            .dur = now - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(now - start),
+            .reg = xfers[i].reg,
+            .flags = (xfers[i].write ? TRACE_WRITE : 0) | (i ? TRACE_BATCH : 0),
+            .len = xfers[i].len,
+            .err = rc >= 0 ? 0 : -rc > UINT8_MAX ? UINT8_MAX : -rc,
+        };
+
+        fwrite(&rec, sizeof(rec), 1, trace->f);
+        fwrite(xfers[i].buf, 1, xfers[i].len, trace->f);
+    }
+    trace->size += size;
+    trace->last = start;
+
+    /* Bounded loss if the daemon dies, one write(2) a second at most */
+    if (now - trace->flushed >= TRACE_FLUSH_INTERVAL) {
+        fflush(trace->f);
+        trace->flushed = now;
+    }
+}
+
+void trace_close(struct I2cDevice *dev)
+{
+    struct trace *trace = dev->trace;
+
+    if (!trace) {
+        return;
+    }
+    dev->trace = NULL;
+    if (fclose(trace->f) != 0) {
+        perror(trace->path);
+    }
+    free(trace);
+}
+
+int trace_next(const uint8_t *buf, size_t size, size_t *pos, const struct trace_record **rec,
+               const uint8_t **data)
+{
+    const struct trace_record *r;
+
+    if (*pos < sizeof(struct trace_header)) {
+        *pos = sizeof(struct trace_header);
+    }
+    if (*pos + sizeof(*r) > size) {
+        return -1;
+    }
+
+    /* Readers copy the data into register images, a corrupt length ends the trace */
+    r = (const struct trace_record *)(buf + *pos);
+    if (r->len == 0 || r->len > I2C_XFER_MAX || *pos + sizeof(*r) + r->len > size) {
+        return -1;
+    }
+
+    *rec = r;
+    *data = buf + *pos + sizeof(*r);
+    *pos += sizeof(*r) + r->len;
+    return 0;
+}
+
+uint8_t *trace_load(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "r");
+    const struct trace_header *hdr;
+    uint8_t *buf;
+    long len;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0) {
+        perror(path);
+        fclose(f);
+        return NULL;
+    }
+    if (!(buf = malloc(len ? len : 1))) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(buf, 1, len, f) != (size_t)len) {
+        perror(path);
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    fclose(f);
+
+    hdr = (const struct trace_header *)buf;
+    if ((size_t)len < sizeof(*hdr) || hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a PMIC trace\n", path);
+        free(buf);
+        return NULL;
+    }
+
+    *size = len;
+    return buf;
+}
+
+int trace_dump(const char *path)
+{
+    const struct trace_header *hdr;
+    const struct trace_record *rec;
+    const uint8_t *data;
+    size_t size, pos = 0;
+    uint64_t t = 0;
+    uint32_t transactions = 0, failed = 0;
+    uint8_t *buf = trace_load(path, &size);
+
+    if (!buf) {
+        return -1;
+    }
+    hdr = (const struct trace_header *)buf;
+    printf("# PMIC 0x%02x, started %llu ms after the epoch\n", hdr->addr, (unsigned long long)hdr->start);
+    printf("#        time dir reg len err      us  data\n");
+
+    while (trace_next(buf, size, &pos, &rec, &data) == 0) {
+        if (!(rec->flags & TRACE_BATCH)) {
+            t += rec->delta;
+            transactions++;
+            failed += rec->err != 0;
+        }
+
+        printf("%13.6f %3s  %02x %3u %3u %7u ", (double)t / 1e6, rec->flags & TRACE_WRITE ? "w" : "r", rec->reg,
+               rec->len, rec->err, rec->dur);
+        /* Read data of a failed transaction is whatever was in the buffer */
+        if (!rec->err || (rec->flags & TRACE_WRITE)) {
+            for (uint8_t i = 0; i < rec->len; i++) {
+                printf(" %02x", data[i]);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("# %u transactions, %u failed, %.1f s\n", transactions, failed, (double)t / 1e6);
+    free(buf);
+    return 0;
+}
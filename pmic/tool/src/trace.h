@@ -0,0 +1,73 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "i2c.h"
+
+#define TRACE_MAGIC 0x52544d50 /* "PMTR" */
+#define TRACE_VERSION 1
+
+/* Capture stops once the file reaches this size, bytes */
+#define TRACE_MAX_SIZE (4 * 1024 * 1024)
+
+/* Longest a captured transaction waits in the stdio buffer, us */
+#define TRACE_FLUSH_INTERVAL 1000000
+
+/* Record flags */
+#define TRACE_WRITE (1 << 0) /* Register write, a read otherwise */
+#define TRACE_BATCH (1 << 1) /* Same transaction as the record before */
+
+struct trace_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t addr;   /* PMIC address */
+    uint64_t start;  /* Wall clock ms the capture started at */
+} __attribute__((packed));
+
+/*
+ * One register transfer, followed by len data bytes: the bytes written or
+ * read, meaningless for a failed read. A transaction has one record per
+ * transfer, all carry its timing and result.
+ */
+struct trace_record
+{
+    uint32_t delta;  /* us from the start of the previous transaction, saturates */
+    uint32_t dur;    /* us the transaction took */
+    uint8_t reg;
+    uint8_t flags;   /* TRACE_* */
+    uint8_t len;
+    uint8_t err;     /* errno of the transaction, 0 - ok */
+} __attribute__((packed));
+
+struct trace;
+
+/* Monotonic time in us, the clock of delta and dur */
+uint64_t trace_clock(void);
+
+/* Create @path and record every transfer of @dev into it */
+int trace_open(struct I2cDevice *dev, const char *path);
+
+/* Append a transaction that started at trace_clock() @start, I2C layer only */
+void trace_write(struct trace *trace, const struct i2c_xfer *xfers, size_t count, int rc, uint64_t start);
+
+/* Flush and stop recording */
+void trace_close(struct I2cDevice *dev);
+
+/*
+ * Walk the records of a trace loaded in memory. @pos starts at 0, returns
+ * 0 with @rec and @data set, or -1 at the end; a record cut short by a
+ * crash or with a length outside 1..I2C_XFER_MAX ends the trace.
+ */
+int trace_next(const uint8_t *buf, size_t size, size_t *pos, const struct trace_record **rec,
+               const uint8_t **data);
+
+/* Read a whole trace file, checks the header, free() the result */
+uint8_t *trace_load(const char *path, size_t *size);
+
+/* Print a trace as text, one line per transfer */
+int trace_dump(const char *path);
+
+#endif
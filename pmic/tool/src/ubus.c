@@ -34,6 +34,12 @@ int pmicctrl_send_event(const char *event_name,
     return 0;
 }
 
+int pmicctrl_notify(struct ubus_object *object, const char *type, struct blob_buf *b)
+{
+    /* Asynchronous, a slow subscriber never blocks the daemon */
+    return ubus_notify(g_ubus_ctx, object, type, b->head, -1);
+}
+
 void pmicctrl_handler_loop(void)
 {
     uloop_run();
@@ -64,6 +70,11 @@ static void __invoke_complete(struct ubus_request* req, int type, struct blob_at
 }
 
 int pmicctrl_call(const char* module, const char* func, struct blob_buf *b, char** str)
+{
+    return pmicctrl_invoke(module, func, b, __invoke_complete, (void*)str);
+}
+
+int pmicctrl_invoke(const char* module, const char* func, struct blob_buf *b, pmicctrl_call_cb_t cb, void *priv)
 {
     uint32_t module_id;
     int lookup_err = ubus_lookup_id(g_ubus_ctx, module, &module_id);
@@ -72,5 +83,29 @@ int pmicctrl_call(const char* module, const char* func, struct blob_buf *b, char
         return lookup_err;
     }
 
-    return ubus_invoke(g_ubus_ctx, module_id, func, b->head, __invoke_complete, (void*)str, 2000);
+    return ubus_invoke(g_ubus_ctx, module_id, func, b->head, cb, priv, 2000);
+}
+
+int pmicctrl_client_init(const char *object)
+{
+    uint32_t id;
+
+    g_ubus_ctx = ubus_connect(NULL);
+    if (!g_ubus_ctx) {
+        return -1;
+    }
+
+    if (ubus_lookup_id(g_ubus_ctx, object, &id) != 0) {
+        pmicctrl_client_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+void pmicctrl_client_cleanup(void)
+{
+    if (g_ubus_ctx) {
+        ubus_free(g_ubus_ctx);
+        g_ubus_ctx = NULL;
+    }
 }
@@ -37,6 +37,17 @@ int pmicctrl_handler_register_object(struct ubus_object *object);
  */
 int pmicctrl_send_event(const char *event_name, struct blob_buf *b);
 
+/**
+ * Notify the subscribers of a registered object (`ubus subscribe`).
+ *
+ * @object: Object the subscribers are attached to.
+ * @type: Notification type, e.g. the topic name.
+ * @b: A blob buffer containing the payload.
+ *
+ * Returns 0 on success, or a UBUS_STATUS_* error.
+ */
+int pmicctrl_notify(struct ubus_object *object, const char *type, struct blob_buf *b);
+
 /**
  * Run the UBUS event loop.
  */
@@ -63,6 +74,30 @@ struct ubus_context *pmicctrl_handler_get_context(void);
  */
 int pmicctrl_call(const char* module, const char* func, struct blob_buf *b, char** str);
 
+/**
+ * Connect to ubus as a client only, without uloop integration.
+ * Returns 0 if @object is registered (its daemon is running), or a
+ * negative value otherwise; the connection is closed in that case.
+ */
+int pmicctrl_client_init(const char *object);
+
+/**
+ * Close a connection opened by pmicctrl_client_init().
+ */
+void pmicctrl_client_cleanup(void);
+
+/**
+ * @brief UBUS-Call with a reply callback
+ *
+ * @param module Module name (pmic)
+ * @param func Function name (regs)
+ * @param b Arguements
+ * @param cb Called with the reply message, may be NULL
+ * @param priv Passed to cb as req->priv
+ * @return 0 or a UBUS_STATUS_* error
+ */
+int pmicctrl_invoke(const char* module, const char* func, struct blob_buf *b, pmicctrl_call_cb_t cb, void *priv);
+
 #ifdef __cplusplus
 }
 #endif